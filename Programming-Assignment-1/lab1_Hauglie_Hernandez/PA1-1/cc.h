@@ -0,0 +1,254 @@
+// congestion control for client11c's reliable transfers (-y), behind one
+// small interface so the transfer loop doesn't care which one runs:
+//
+//     aimd  Reno-style. slow start, then one more packet per round trip;
+//           halved once per round trip that loses packets, and back to one
+//           packet after a timeout. sends as fast as the window allows.
+//     bbr   BBR-like. models the path as a bottleneck rate (the highest
+//           delivery rate of the last CC_BW_ROUNDS round trips) and a
+//           propagation delay (the lowest RTT of the last CC_RTT_WINDOW),
+//           paces at a gain over the rate that cycles to probe for more
+//           and to drain the queue that made, and keeps about two
+//           rate x delay in flight. random loss doesn't shrink it.
+//
+// windows are in packets, since a transfer's messages are all about one
+// size, and rates in packets per second.
+#ifndef CC_H
+#define CC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CC_INIT_CWND 10
+#define CC_MIN_CWND 4          // bbr's floor; aimd goes down to 1 on a timeout
+#define CC_BW_ROUNDS 10
+#define CC_RTT_WINDOW 10000000000ULL  // ns
+#define CC_PROBE_RTT_NS 200000000ULL   // how long PROBE_RTT holds the window down
+#define CC_HIGH_GAIN 2.885     // 2/ln 2: doubles the rate every round trip
+#define CC_CYCLE 8
+
+// what one ack told the transfer
+struct cc_ack {
+    uint64_t now_ns;
+    uint64_t rtt_ns;          // 0 = no sample
+    uint64_t acked;           // packets newly delivered
+    uint64_t inflight;        // outstanding after it
+    uint64_t delivered;       // packets delivered so far
+    uint64_t prior_delivered; // delivered when the newest acked packet was sent
+    double rate;              // delivery rate sample, 0 = none
+};
+
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+
+struct cc {
+    const struct cc_ops *ops;
+    double cwnd;          // packets that may be in flight
+    double pacing_rate;   // packets per second, 0 = as fast as the window allows
+
+    // aimd
+    double ssthresh;
+    uint64_t recovery_ns; // a loss of a packet sent before this is the same event
+
+    // bbr
+    int mode;
+    double bw;            // bottleneck rate estimate
+    double bw_round[CC_BW_ROUNDS];
+    uint64_t round, next_round;
+    uint64_t min_rtt_ns, min_rtt_at;
+    double full_bw;       // startup: the rate 3 round trips of growth are measured against
+    int full_bw_rounds, full;
+    int cycle;
+    uint64_t cycle_at, probe_rtt_end;
+    double pacing_gain, cwnd_gain;
+};
+
+struct cc_ops {
+    const char *name;
+    void (*init)(struct cc *c, uint64_t now_ns);
+    void (*on_ack)(struct cc *c, const struct cc_ack *a);
+    // a packet sent at sent_ns was found lost without a timeout
+    void (*on_loss)(struct cc *c, uint64_t now_ns, uint64_t sent_ns);
+    void (*on_rto)(struct cc *c, uint64_t now_ns);
+};
+
+static void aimd_init(struct cc *c, uint64_t now_ns)
+{
+    (void)now_ns;
+    c->cwnd = CC_INIT_CWND;
+    c->ssthresh = 1e18;
+    c->pacing_rate = 0;
+}
+
+static void aimd_on_ack(struct cc *c, const struct cc_ack *a)
+{
+    if (c->cwnd < c->ssthresh)
+        c->cwnd += a->acked;
+    else
+        c->cwnd += a->acked / c->cwnd;
+}
+
+static void aimd_on_loss(struct cc *c, uint64_t now_ns, uint64_t sent_ns)
+{
+    if (sent_ns < c->recovery_ns)
+        return;
+    c->ssthresh = c->cwnd / 2 > 2 ? c->cwnd / 2 : 2;
+    c->cwnd = c->ssthresh;
+    c->recovery_ns = now_ns;
+}
+
+static void aimd_on_rto(struct cc *c, uint64_t now_ns)
+{
+    c->ssthresh = c->cwnd / 2 > 2 ? c->cwnd / 2 : 2;
+    c->cwnd = 1;
+    c->recovery_ns = now_ns;
+}
+
+static const double bbr_cycle_gain[CC_CYCLE] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static void bbr_init(struct cc *c, uint64_t now_ns)
+{
+    c->cwnd = CC_INIT_CWND;
+    c->pacing_rate = 0;
+    c->mode = BBR_STARTUP;
+    c->pacing_gain = c->cwnd_gain = CC_HIGH_GAIN;
+    c->min_rtt_at = now_ns;
+}
+
+static double bbr_bdp(const struct cc *c)
+{
+    return c->bw * c->min_rtt_ns / 1e9;
+}
+
+static void bbr_probe_bw(struct cc *c, uint64_t now_ns)
+{
+    c->mode = BBR_PROBE_BW;
+    c->pacing_gain = bbr_cycle_gain[c->cycle = 2];
+    c->cwnd_gain = 2;
+    c->cycle_at = now_ns;
+}
+
+static void bbr_on_ack(struct cc *c, const struct cc_ack *a)
+{
+    int round_start = 0, expired;
+    double target;
+
+    // a round trip ends when a packet sent after it began is acked
+    if (a->prior_delivered >= c->next_round) {
+        c->next_round = a->delivered;
+        c->round++;
+        c->bw_round[c->round % CC_BW_ROUNDS] = 0;
+        round_start = 1;
+    }
+    if (a->rate > c->bw_round[c->round % CC_BW_ROUNDS])
+        c->bw_round[c->round % CC_BW_ROUNDS] = a->rate;
+    c->bw = 0;
+    for (int i = 0; i < CC_BW_ROUNDS; i++)
+        if (c->bw_round[i] > c->bw)
+            c->bw = c->bw_round[i];
+
+    // an old minimum is replaced by whatever comes next, and makes us
+    // drain the queue for a moment so that is the real propagation delay
+    expired = a->now_ns > c->min_rtt_at + CC_RTT_WINDOW;
+    if (a->rtt_ns > 0 && (c->min_rtt_ns == 0 || a->rtt_ns <= c->min_rtt_ns || expired)) {
+        c->min_rtt_ns = a->rtt_ns;
+        c->min_rtt_at = a->now_ns;
+    }
+    if (expired && c->mode != BBR_PROBE_RTT) {
+        c->mode = BBR_PROBE_RTT;
+        c->pacing_gain = c->cwnd_gain = 1;
+        c->probe_rtt_end = 0;
+    }
+
+    switch (c->mode) {
+    case BBR_STARTUP:
+        // the pipe is full once 3 round trips in a row grew the rate < 25%
+        if (round_start && c->bw > 0) {
+            if (c->bw >= c->full_bw * 1.25) {
+                c->full_bw = c->bw;
+                c->full_bw_rounds = 0;
+            } else if (++c->full_bw_rounds >= 3) {
+                c->full = 1;
+                c->mode = BBR_DRAIN;
+                c->pacing_gain = 1 / CC_HIGH_GAIN;
+            }
+        }
+        break;
+    case BBR_DRAIN:
+        if (a->inflight <= bbr_bdp(c))
+            bbr_probe_bw(c, a->now_ns);
+        break;
+    case BBR_PROBE_BW:
+        // each phase lasts a min RTT; 1.25 probes for more rate, 0.75
+        // drains what that queued, then cruise
+        if (a->now_ns > c->cycle_at + c->min_rtt_ns) {
+            c->cycle = (c->cycle + 1) % CC_CYCLE;
+            c->pacing_gain = bbr_cycle_gain[c->cycle];
+            c->cycle_at = a->now_ns;
+        }
+        break;
+    case BBR_PROBE_RTT:
+        if (c->probe_rtt_end == 0 && a->inflight <= CC_MIN_CWND)
+            c->probe_rtt_end = a->now_ns + CC_PROBE_RTT_NS;
+        if (c->probe_rtt_end != 0 && a->now_ns >= c->probe_rtt_end) {
+            c->min_rtt_at = a->now_ns;
+            if (c->full) {
+                bbr_probe_bw(c, a->now_ns);
+            } else {
+                c->mode = BBR_STARTUP;
+                c->pacing_gain = c->cwnd_gain = CC_HIGH_GAIN;
+            }
+        }
+        break;
+    }
+
+    if (c->bw > 0)
+        c->pacing_rate = c->pacing_gain * c->bw;
+    // grow like slow start until the model has a target, then towards it
+    target = c->cwnd_gain * bbr_bdp(c) + 2;
+    if (c->full && c->cwnd + a->acked > target)
+        c->cwnd = target;
+    else if (!c->full || c->cwnd < target)
+        c->cwnd += a->acked;
+    if (c->mode == BBR_PROBE_RTT && c->cwnd > CC_MIN_CWND)
+        c->cwnd = CC_MIN_CWND;
+    if (c->cwnd < CC_MIN_CWND)
+        c->cwnd = CC_MIN_CWND;
+}
+
+static void bbr_on_loss(struct cc *c, uint64_t now_ns, uint64_t sent_ns)
+{
+    (void)c;
+    (void)now_ns;
+    (void)sent_ns;
+}
+
+// everything in flight is gone; start over from a small window and let
+// the model (which a timeout doesn't change) bring it back
+static void bbr_on_rto(struct cc *c, uint64_t now_ns)
+{
+    (void)now_ns;
+    c->cwnd = CC_MIN_CWND;
+}
+
+static const struct cc_ops cc_algos[] = {
+    { "aimd", aimd_init, aimd_on_ack, aimd_on_loss, aimd_on_rto },
+    { "bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_rto },
+};
+
+// NULL if there is no controller by that name
+static inline const struct cc_ops *cc_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof cc_algos / sizeof cc_algos[0]; i++)
+        if (strcmp(cc_algos[i].name, name) == 0)
+            return &cc_algos[i];
+    return NULL;
+}
+
+static inline void cc_init(struct cc *c, const struct cc_ops *ops, uint64_t now_ns)
+{
+    memset(c, 0, sizeof *c);
+    c->ops = ops;
+    ops->init(c, now_ns);
+}
+
+#endif
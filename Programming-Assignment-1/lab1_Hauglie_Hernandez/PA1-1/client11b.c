@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
@@ -9,6 +11,10 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <endian.h>
+
+#include "tstamp.h"
+#include "proto.h"
 
 #define SERVERPORT "10010"
 #define MAXBUFLEN 1100
@@ -19,6 +25,56 @@ long long get_time_ms() {
     return (long long)(tv.tv_sec * 1000000 + tv.tv_usec);
 }
 
+// the offset estimate from the sample with the least network delay is the
+// least disturbed by queueing (NTP's clock filter idea)
+long long best_delay = -1;
+long long best_offset;
+
+// split one exchange into forward delay, reverse delay and server dwell.
+// t1/t4 are our send/receive times, t2/t3 the server's, all in ns.
+void print_reflect(long long t1, long long t2, long long t3, long long t4)
+{
+    long long dwell = t3 - t2;
+    long long delay = (t4 - t1) - dwell;
+    long long offset = ((t2 - t1) + (t3 - t4)) / 2;
+
+    if (best_delay < 0 || delay < best_delay) {
+        best_delay = delay;
+        best_offset = offset;
+    }
+
+    printf("server dwell: %.3f ms, network: %.3f ms\n", dwell / 1e6, delay / 1e6);
+    printf("forward: %.3f ms, reverse: %.3f ms (clock offset %.3f ms)\n",
+           (t2 - t1 - best_offset) / 1e6, (t4 - t3 + best_offset) / 1e6, best_offset / 1e6);
+}
+
+// kernel stamps for the last exchange (-K): the TX stamp is read off the
+// error queue by key, after the reply, by which time the kernel has long
+// since queued it. the hardware one may still be on its way and is only
+// printed if it made it.
+void print_kernel(int sockfd, uint32_t want_key, struct msghdr *reply, double user_ms)
+{
+    struct kstamp tx = {0}, rx, t;
+    uint32_t key;
+
+    while (tstamp_tx(sockfd, &key, &t) == 1) {
+        if (key != want_key)
+            continue;
+        if (t.sw)
+            tx.sw = t.sw;
+        if (t.hw)
+            tx.hw = t.hw;
+    }
+    if (!tstamp_parse(reply, &rx) || tx.sw == 0 || rx.sw == 0) {
+        printf("no kernel timestamps for this exchange\n");
+        return;
+    }
+    printf("kernel round trip time: %.3f ms (host overhead %.3f ms)\n",
+           (rx.sw - tx.sw) / 1e6, user_ms - (rx.sw - tx.sw) / 1e6);
+    if (tx.hw && rx.hw)
+        printf("hardware round trip time: %.3f ms\n", (rx.hw - tx.hw) / 1e6);
+}
+
 int main(int argc, char *argv[])
 {
     int sockfd;
@@ -32,9 +88,33 @@ int main(int argc, char *argv[])
     unsigned int seq_num = 1;
     long long timestamp;
     long long send_time, recv_time;
+    int reflect = 0;
+    int kernel = 0;
+    int trailer = 0;    // -c: CRC_TRAILER
+    int corrupt = 0;
+    uint32_t sends = 0; // successful sends, which is the next send's TX key
+    char ctrl[TSTAMP_CTRLLEN];
+    struct iovec iov = { recv_buf, sizeof recv_buf };
+    struct msghdr msg;
+    int hdr_len = PROTO_HDRLEN;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "TKc")) != -1) {
+        if (opt == 'T') {
+            reflect = 1;
+            hdr_len = REFLECT_HDRLEN;
+        } else if (opt == 'K') {
+            kernel = 1;
+        } else if (opt == 'c') {
+            trailer = CRC_TRAILER;
+        } else {
+            fprintf(stderr,"usage: client11b [-T] [-K] [-c] hostname\n");
+            exit(1);
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr,"usage: client11b hostname\n");
+    if (argc - optind != 1) {
+        fprintf(stderr,"usage: client11b [-T] [-K] [-c] hostname\n");
         exit(1);
     }
 
@@ -42,7 +122,7 @@ int main(int argc, char *argv[])
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_DGRAM;
 
-    if ((rv = getaddrinfo(argv[1], SERVERPORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(argv[optind], SERVERPORT, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return 1;
     }
@@ -62,6 +142,11 @@ int main(int argc, char *argv[])
         return 2;
     }
 
+    if (kernel && tstamp_enable(sockfd) == -1) {
+        perror("client: setsockopt SO_TIMESTAMPING");
+        return 1;
+    }
+
     // main client loop
     while(1) {
         printf("Enter string to send (or 'quit' to exit): ");
@@ -76,16 +161,16 @@ int main(int argc, char *argv[])
         }
         
         int string_len = strlen(input);
-        int total_len = 2 + 4 + 8 + string_len;
-        
-        unsigned short net_msg_len = htons(total_len);
-        unsigned int net_seq_num = htonl(seq_num);
-        long long net_timestamp = get_time_ms();
+        int total_len = hdr_len + string_len + trailer;
         
-        memcpy(send_buf, &net_msg_len, 2);
-        memcpy(send_buf + 2, &net_seq_num, 4);
-        memcpy(send_buf + 6, &net_timestamp, 8);
-        memcpy(send_buf + 14, input, string_len);
+        proto_set_header(send_buf, total_len, seq_num, get_time_ms());
+        // -T: ask a server11 -R to stamp its receive and transmit times
+        if (reflect)
+            proto_reflect_init(send_buf);
+        memcpy(send_buf + hdr_len, input, string_len);
+        // -c: checksum last, over the finished datagram
+        if (trailer)
+            proto_crc_seal(send_buf, total_len);
 
         send_time = get_time_ms();
 
@@ -96,16 +181,36 @@ int main(int argc, char *argv[])
         }
 
         printf("sent %d bytes\n", numbytes);
-
-        if ((numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN, 0, NULL, NULL)) == -1) {
-            perror("recvfrom");
+        sends++;
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof ctrl;
+        if ((numbytes = recvmsg(sockfd, &msg, 0)) == -1) {
+            perror("recvmsg");
             continue;
         }
 
         recv_time = get_time_ms();
 
-        printf("received echo: %.*s\n", numbytes - 14, recv_buf + 14);
+        printf("received echo: %.*s\n", numbytes - hdr_len - trailer, recv_buf + hdr_len);
         printf("round trip time: %.2f ms\n", (double)recv_time / 1000.0 - (double)send_time / 1000.0);
+        if (kernel)
+            print_kernel(sockfd, sends - 1, &msg, (recv_time - send_time) / 1000.0);
+        if (trailer && proto_crc_check(recv_buf, numbytes) == CRC_OK)
+            printf("CRC32C: ok\n");
+        else if (trailer)
+            printf("CRC32C: MISMATCH, echo corrupted (%d so far)\n", ++corrupt);
+
+        if (reflect && numbytes >= REFLECT_HDRLEN) {
+            if (proto_reflect_rx(recv_buf) != 0)
+                print_reflect(send_time * 1000, proto_reflect_rx(recv_buf),
+                              proto_reflect_tx(recv_buf), recv_time * 1000);
+            else
+                printf("server did not stamp the reply (not running with -R?)\n");
+        }
         printf("---\n");
 
         seq_num++;  
@@ -1,55 +1,2056 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h>
-#include <sys/wait.h>
+#include <endian.h>
+#include <math.h>
+
+#include "hist.h"
+#include "tstamp.h"
+#include "trace.h"
+#include "proto.h"
+#include "cc.h"
 
 #define SERVERPORT "10010"
-#define MAXBUFLEN 1100
-#define MAX_NUMS 10000
+#define MAXBUFLEN 65507 // largest UDP payload over IPv4 (-l, -z)
+#define DRAIN_MS 1000   // how long to wait for stragglers after the last send
+#define LATE_NS 10000   // a send this far behind its slot counts as late
+#define MAXMERGE 16     // -A files
+#define WINDOW (1 << 18) // seq_nums in flight that can be told apart, power of 2
+#define MAXFLOWS 64     // -f sockets
+#define SCHEDMAX 1024   // sum of the -w weights
+#define BASELINE_EXIT 3 // exit status when -B finds a regression
+#define MAXSTEPS 64     // -z sizes
+#define STEP_GAP_MS 200 // pause between -z sizes for the last replies to come back
+#define MAXSEND 256     // datagrams per sendmmsg (-b)
+#define BATCH_US 50     // -b auto: a batch every this many us at the target rate
+#define FLUSH_US 100    // -m: longest a message waits for others to share its datagram
+
+// min/sum/max of one one-way component, in ns
+struct delay_stats {
+    long long min, max, sum;
+    int count;
+};
+
+// what the sender remembers about one seq_num, in a ring indexed by
+// seq_num. a seqlock: seq is 0 while the slot is being rewritten, so the
+// receiver can tell a slot that has moved on to a newer seq_num.
+struct sendslot {
+    uint64_t seq;
+    uint64_t sent_ns;  // CLOCK_MONOTONIC
+    uint64_t due_ns;   // the slot it was scheduled for
+    uint64_t pad;
+};
+
+// reply accounting for one interval; rxcount_add folds it into the totals
+struct rxcount {
+    uint64_t received;   // first reply for a seq_num still in the window
+    uint64_t lost;       // settled with no reply
+    uint64_t late;       // reply for a seq_num already settled (as lost, or a late copy)
+    uint64_t dups;       // second reply for a seq_num in the window
+    uint64_t reordered;  // arrived after a higher seq_num
+    uint64_t reorder_sum, reorder_max; // how far behind the highest, in seq_nums
+    uint64_t stray;      // too short, or not a seq_num we sent
+    uint64_t truncated;  // echo shorter than what was sent
+    uint64_t corrupt;    // CRC32C trailer didn't match (-c); its seq_num settles as lost
+    uint64_t unsynced;   // compact header (-k) of an epoch whose sync was lost; settles as lost
+};
+
+// -m: messages waiting to go out together in one datagram
+struct bundle {
+    char *buf;         // MAXBUFLEN
+    int len, n;
+    uint64_t first_ns; // when the oldest went in, for the flush deadline
+    struct bundled {
+        uint64_t seq, at, due;
+        int len;
+    } *msgs;
+};
+
+// one source socket (-f), so one 5-tuple. the sender owns sent,
+// send_errors, bundle and the compact header's tx side, the receiver the
+// rest; the totals are these summed.
+struct flow {
+    int fd;
+    unsigned short port;   // local (source) port
+    uint64_t sent, send_errors;
+    struct bundle bundle;
+    struct proto_sync tx_sync, rx_sync; // -k: each direction's current epoch
+    int since_sync;        // -k: messages built since the last sync
+    uint64_t max_seq;      // highest seq_num replied to on this flow
+    struct rxcount ivl, cnt;
+    struct hist rtt;
+};
+
+// what a -p replay sent for one seq_num, in a ring indexed like the
+// send ring. written before the seq_num is published in seq_hi.
+struct traced {
+    uint16_t size;
+    uint8_t flow;
+};
+
+// which flow each seq_num goes out on: seq_num s uses flow[(s - 1) % len].
+// it only depends on s, so the receiver can tell which flow a lost
+// seq_num belonged to, and which seq_num a flow's nth TX stamp is for.
+// a replay (-p) takes the flow from the trace instead.
+struct sched {
+    int len;
+    struct traced *replay; // -p: WINDOW slots, NULL otherwise
+    uint16_t flow[SCHEDMAX];
+    int per_cycle[MAXFLOWS];  // positions each flow has in flow[]
+    int first[MAXFLOWS];      // where they start in order[]
+    uint16_t order[SCHEDMAX]; // positions in flow[], grouped by flow
+};
+
+// one datagram size of a -z sweep, or one window of a -W sweep:
+// seq_nums (k * count, (k + 1) * count]
+struct step {
+    int size;
+    int window;
+    // sender's, read once it has been joined
+    uint64_t sent, start_ns, end_ns;
+    struct rxcount c;
+    struct hist rtt;
+};
+
+// state shared by the sender thread and the receiver (main) thread
+struct loadgen {
+    int nflows;
+    struct flow *flows;
+    struct sched sched;
+    uint64_t rx_ready;  // receiver: flows poll said had something
+    int rx_next;        // receiver: flow to try first
+    uint64_t count;    // datagrams to send, seq_nums 1..count; 0 = until interrupted
+                       // (in a sweep, datagrams per size)
+    double rate;       // target datagrams per second, 0 = as fast as possible
+    int size;          // datagram size, 0 = header plus the seq_num as text
+    int window;        // closed loop (-W): seq_nums kept in flight, 0 = open loop
+    int batch;         // datagrams per sendmmsg, 1 = one send per datagram
+    int mtu;           // -m: pack messages into datagrams of up to this many bytes, 0 = one each
+    uint64_t flush_ns; // -m: send a bundle once its oldest message has waited this long
+    int nsteps;        // -z sizes, 0 = no sweep
+    struct step *steps;
+    long spin_ns;      // spin this close to each slot instead of sleeping
+    struct trace_writer *trace;            // -t, NULL if not recording
+    struct trace_chunk *tx_trace, *rx_trace; // the sending and receiving threads' chunks
+    struct trace_reader *replay;           // -p, NULL if not replaying
+    double speed;      // -x: replay this many times faster than recorded
+    int hdr_len;       // with -k the longest compact header, for sizing
+    int compact;       // -k: compact header, a sync every this many messages per flow
+    int trailer;       // -c: CRC_TRAILER bytes at the end of every datagram, else 0
+    int reflect;
+    int reliable;      // -y: data messages, acked by the server
+    struct sendslot *ring; // WINDOW slots
+
+    // written by the sender; the receiver reads them as it goes
+    uint64_t start_ns, end_ns;
+    uint64_t seq_hi;   // newest seq_num sent
+    uint64_t sent, send_errors, late;
+    uint64_t datagrams; // -m: how many datagrams the sent messages took
+    uint64_t hdr_bytes, syncs; // -k: compact header bytes and syncs built
+    uint64_t max_lag_ns, total_lag_ns;
+    int done;
+};
+
+// sliding window over seq_nums, one bit per reply seen. everything below
+// base has been settled as received or lost, so memory stays at WINDOW
+// bits however long the run goes.
+struct seqwin {
+    uint64_t base;
+    uint64_t max;      // highest seq_num replied to
+    uint64_t seen;     // bits set between base and max
+    uint64_t bits[WINDOW / 64];
+};
+
+// kernel stamps for one seq_num (-K), in a receiver-only ring indexed
+// like the send ring. the TX stamp comes off the error queue and the RX
+// stamp with the reply, in either order; whichever completes a pair
+// records the kernel RTT.
+struct kslot {
+    uint64_t seq;
+    struct kstamp tx, rx;
+    uint64_t user_ns;  // user space RTT of the reply
+    int done;          // KS_SW / KS_HW once that RTT has been recorded
+};
+
+#define KS_SW 1
+#define KS_HW 2
+
+// kernel RTT histograms and the replies or sends that had no stamp
+struct kstats {
+    struct hist sw, hw, host; // host: user space RTT minus kernel RTT
+    uint64_t tx_stamps, rx_stamps;
+};
+
+static volatile sig_atomic_t stop;
+
+void delay_add(struct delay_stats *d, long long v)
+{
+    if (d->count == 0 || v < d->min) d->min = v;
+    if (d->count == 0 || v > d->max) d->max = v;
+    d->sum += v;
+    d->count++;
+}
+
+// shift is the clock offset correction, applied once the best estimate is known
+void delay_print(const char *name, const struct delay_stats *d, long long shift)
+{
+    printf("%s: min %.3f ms, avg %.3f ms, max %.3f ms\n", name,
+           (d->min + shift) / 1e6, ((double)d->sum / d->count + shift) / 1e6,
+           (d->max + shift) / 1e6);
+}
+
+long long get_time_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)(tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+void hist_print(const char *name, const struct hist *h)
+{
+    printf("%s: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, p99.99 %.3f ms, "
+           "max %.3f ms (%llu samples)\n", name,
+           hist_pct(h, 0.5) / 1e6, hist_pct(h, 0.9) / 1e6, hist_pct(h, 0.99) / 1e6,
+           hist_pct(h, 0.999) / 1e6, hist_pct(h, 0.9999) / 1e6, h->max / 1e6,
+           (unsigned long long)h->total);
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// block on the timerfd until deadline, minus spin_ns which is burned in a
+// clock loop instead so the send lands on the slot rather than on the
+// next timer interrupt
+void wait_until(int tfd, uint64_t deadline, long spin_ns)
+{
+    struct itimerspec its;
+    uint64_t expirations;
+    uint64_t now = now_ns();
+
+    if (deadline > now + spin_ns) {
+        uint64_t wake = deadline - spin_ns;
+        memset(&its, 0, sizeof its);
+        its.it_value.tv_sec = wake / 1000000000;
+        its.it_value.tv_nsec = wake % 1000000000;
+        if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+            while (read(tfd, &expirations, sizeof expirations) == -1 && errno == EINTR)
+                ;
+    }
+    while (spin_ns > 0 && now_ns() < deadline)
+        ;
+}
+
+// publish what was sent for seq in its ring slot (seqlock writer)
+void ring_put(struct loadgen *g, uint64_t seq, uint64_t sent_ns, uint64_t due_ns)
+{
+    struct sendslot *sl = &g->ring[seq & (WINDOW - 1)];
+
+    __atomic_store_n(&sl->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&sl->sent_ns, sent_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&sl->due_ns, due_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&sl->seq, seq, __ATOMIC_RELEASE);
+}
+
+// read back seq's send and due times; 0 if its slot has been reused
+int ring_get(const struct loadgen *g, uint64_t seq, uint64_t *sent_ns, uint64_t *due_ns)
+{
+    const struct sendslot *sl = &g->ring[seq & (WINDOW - 1)];
+
+    if (__atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE) != seq)
+        return 0;
+    *sent_ns = __atomic_load_n(&sl->sent_ns, __ATOMIC_RELAXED);
+    *due_ns = __atomic_load_n(&sl->due_ns, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// smooth weighted round-robin over the flows (as in nginx): every flow
+// gets its share of each cycle, spread out rather than in runs
+int sched_build(struct sched *s, const int *weight, int n)
+{
+    int cur[MAXFLOWS] = {0}, total = 0;
+
+    for (int i = 0; i < n; i++)
+        total += weight[i];
+    if (total > SCHEDMAX)
+        return -1;
+    s->len = total;
+    memset(s->per_cycle, 0, sizeof s->per_cycle);
+    for (int k = 0; k < total; k++) {
+        int best = 0;
+        for (int i = 0; i < n; i++) {
+            cur[i] += weight[i];
+            if (cur[i] > cur[best])
+                best = i;
+        }
+        cur[best] -= total;
+        s->flow[k] = best;
+        s->per_cycle[best]++;
+    }
+    for (int i = 0, at = 0; i < n; i++) {
+        s->first[i] = at;
+        for (int k = 0; k < total; k++)
+            if (s->flow[k] == i)
+                s->order[at++] = k;
+    }
+    return 0;
+}
+
+int flow_of(const struct sched *s, uint64_t seq)
+{
+    if (s->replay != NULL)
+        return s->replay[seq & (WINDOW - 1)].flow;
+    return s->flow[(seq - 1) % s->len];
+}
+
+int step_of(const struct loadgen *g, uint64_t seq)
+{
+    return (seq - 1) / g->count;
+}
+
+// how long seq's datagram was, 0 if it depended on the seq_num
+int size_of(const struct loadgen *g, uint64_t seq)
+{
+    if (g->sched.replay != NULL)
+        return g->sched.replay[seq & (WINDOW - 1)].size;
+    return g->nsteps > 0 ? g->steps[step_of(g, seq)].size : g->size;
+}
+
+// the seq_num that was flow f's nth (from 0) successful send. failed
+// sends keep their seq_num for the next try, so no seq_num is skipped.
+uint64_t sched_seq(const struct sched *s, int f, uint64_t n)
+{
+    int c = s->per_cycle[f];
+    return 1 + n / c * s->len + s->order[s->first[f] + n % c];
+}
+
+// build everything of seq's datagram in buf (zeroed once so padding is
+// zeros) but the protocol header, and return its length
+int build_body(const struct loadgen *g, char *buf, uint64_t seq)
+{
+    int size = size_of(g, seq);
+    char num_str[24];
+
+    sprintf(num_str, "%llu", (unsigned long long)seq);
+    int string_len = strlen(num_str);
+    int total_len = g->hdr_len + string_len + g->trailer;
+    // -y: room for the ack to be written over the message, in case the
+    // server gets it coalesced with others and can't just shorten it
+    if (g->reliable && total_len < ACK_LEN + g->trailer)
+        total_len = ACK_LEN + g->trailer;
+    // a fixed size cuts the number short or pads it out
+    if (size > 0) {
+        total_len = size;
+        if (string_len > size - g->hdr_len - g->trailer)
+            string_len = size - g->hdr_len - g->trailer;
+    }
+
+    if (g->reflect)
+        proto_reflect_init(buf);
+    if (g->reliable)
+        proto_data_init(buf);
+    memcpy(buf + g->hdr_len, num_str, string_len);
+    return total_len;
+}
+
+// -k: build seq's message with a compact header, stamped ts_us, in buf
+// and return its length. how long the header is depends on the length,
+// and the length (unless fixed) on the header, so the header goes in
+// first and the body after it.
+int build_compact(struct loadgen *g, char *buf, uint64_t seq, uint64_t ts_us)
+{
+    struct flow *f = &g->flows[flow_of(&g->sched, seq)];
+    int size = size_of(g, seq), sync, len, hl, string_len;
+    char num_str[24];
+
+    sync = f->since_sync >= g->compact || proto_must_sync(&f->tx_sync, seq, ts_us);
+    string_len = sprintf(num_str, "%llu", (unsigned long long)seq);
+    len = size > 0 ? size : (int)proto_compact_len(&f->tx_sync, sync, seq, ts_us,
+                                                   string_len + g->trailer);
+    hl = proto_compact_put(&f->tx_sync, buf, len, sync, seq, ts_us);
+    if (string_len > len - hl - g->trailer)
+        string_len = len - hl - g->trailer;
+    memcpy(buf + hl, num_str, string_len);
+    f->since_sync = sync ? 1 : f->since_sync + 1;
+    g->hdr_bytes += hl;
+    g->syncs += sync;
+    return len;
+}
+
+// build seq's whole datagram in buf and return its length. the wire
+// seq_num is the low 32 bits; the receiver widens it back.
+int build_one(struct loadgen *g, char *buf, uint64_t seq)
+{
+    int len;
+
+    if (g->compact) {
+        len = build_compact(g, buf, seq, get_time_ms());
+    } else {
+        len = build_body(g, buf, seq);
+        proto_set_header(buf, len, seq, get_time_ms());
+    }
+    if (g->trailer)
+        proto_crc_seal(buf, len);
+    return len;
+}
+
+// count a successful send of seq (len bytes) at now. due is its slot in
+// the schedule, for the lag counters; 0 means it had none. with -m the
+// trace gets the datagram instead (bundle_flush).
+void sent_one(struct loadgen *g, uint64_t seq, int len, uint64_t now, uint64_t due)
+{
+    struct step *st = g->nsteps > 0 ? &g->steps[step_of(g, seq)] : NULL;
+    int fl = flow_of(&g->sched, seq);
+    struct flow *f = &g->flows[fl];
+
+    __atomic_store_n(&g->sent, g->sent + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->sent, f->sent + 1, __ATOMIC_RELAXED);
+    if (g->trace != NULL && g->mtu == 0)
+        trace_put(g->trace, g->tx_trace, now, len, fl, TRACE_SENT);
+    if (st != NULL) {
+        if (st->sent++ == 0)
+            st->start_ns = now;
+        st->end_ns = now;
+    }
+    if (due != 0 && now > due) {
+        g->total_lag_ns += now - due;
+        if (now - due > g->max_lag_ns)
+            g->max_lag_ns = now - due;
+        if (now - due > LATE_NS)
+            g->late++;
+    }
+}
+
+// count a failed send of seq. with -k the flow's next message is a sync,
+// in case this one was and the server never sees it.
+void send_failed(struct loadgen *g, uint64_t seq)
+{
+    struct flow *f = &g->flows[flow_of(&g->sched, seq)];
+
+    __atomic_store_n(&g->send_errors, g->send_errors + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->send_errors, f->send_errors + 1, __ATOMIC_RELAXED);
+    f->tx_sync.valid = 0;
+}
+
+// -m: send flow fl's bundle as one datagram. each message counts as sent
+// (or failed) on its own, from when it went into the bundle. a failed
+// send can't hand its seq_nums back, since later ones may be out
+// already, so they settle as lost.
+void bundle_flush(struct loadgen *g, int fl)
+{
+    struct bundle *b = &g->flows[fl].bundle;
+
+    if (b->n == 0)
+        return;
+    if (send(g->flows[fl].fd, b->buf, b->len, 0) == -1) {
+        for (int i = 0; i < b->n; i++)
+            send_failed(g, b->msgs[i].seq);
+    } else {
+        g->datagrams++;
+        if (g->trace != NULL)
+            trace_put(g->trace, g->tx_trace, now_ns(), b->len, fl, TRACE_SENT);
+        for (int i = 0; i < b->n; i++)
+            sent_one(g, b->msgs[i].seq, b->msgs[i].len, b->msgs[i].at, b->msgs[i].due);
+    }
+    b->len = b->n = 0;
+}
+
+// -m: add seq's message (len bytes in buf) to its flow's bundle. the
+// bundle goes out first if the message wouldn't fit, and right after if
+// it is now full.
+void bundle_add(struct loadgen *g, const char *buf, int len, uint64_t seq,
+                uint64_t now, uint64_t due)
+{
+    int fl = flow_of(&g->sched, seq);
+    struct bundle *b = &g->flows[fl].bundle;
+
+    if (b->n > 0 && b->len + len > g->mtu)
+        bundle_flush(g, fl);
+    if (b->n == 0)
+        b->first_ns = now;
+    memcpy(b->buf + b->len, buf, len);
+    b->msgs[b->n++] = (struct bundled){ seq, now, due, len };
+    b->len += len;
+    if (b->len + g->hdr_len + g->trailer > g->mtu)
+        bundle_flush(g, fl);
+}
+
+// -m: send every bundle that is due by now
+void bundle_expire(struct loadgen *g, uint64_t now)
+{
+    for (int i = 0; i < g->nflows; i++) {
+        struct bundle *b = &g->flows[i].bundle;
+        if (b->n > 0 && b->first_ns + g->flush_ns <= now)
+            bundle_flush(g, i);
+    }
+}
+
+// -m: when the next bundle is due, 0 if none is waiting
+uint64_t bundle_deadline(const struct loadgen *g)
+{
+    uint64_t dl = 0;
+
+    for (int i = 0; i < g->nflows; i++) {
+        const struct bundle *b = &g->flows[i].bundle;
+        if (b->n > 0 && (dl == 0 || b->first_ns + g->flush_ns < dl))
+            dl = b->first_ns + g->flush_ns;
+    }
+    return dl;
+}
+
+// wait_until due, sending any -m bundle that comes due first
+void pace_until(struct loadgen *g, int tfd, uint64_t due)
+{
+    uint64_t dl;
+
+    while (g->mtu > 0 && (dl = bundle_deadline(g)) != 0 && dl < due) {
+        wait_until(tfd, dl, g->spin_ns);
+        bundle_expire(g, dl);
+    }
+    wait_until(tfd, due, g->spin_ns);
+}
+
+// send seq's datagram on its flow, building it in buf (MAXBUFLEN), or
+// with -m add it to the flow's bundle. returns -1 if the send failed, and
+// seq should be tried again.
+int send_one(struct loadgen *g, char *buf, uint64_t seq, uint64_t due)
+{
+    struct flow *f = &g->flows[flow_of(&g->sched, seq)];
+    int len = build_one(g, buf, seq);
+    uint64_t now;
+
+    // published before it goes out, so even a very fast reply finds it
+    now = now_ns();
+    ring_put(g, seq, now, due ? due : now);
+    __atomic_store_n(&g->seq_hi, seq, __ATOMIC_RELEASE);
+    if (g->mtu > 0) {
+        bundle_add(g, buf, len, seq, now, due);
+        return 0;
+    }
+    if (send(f->fd, buf, len, 0) == -1) {
+        __atomic_store_n(&g->seq_hi, seq - 1, __ATOMIC_RELEASE);
+        send_failed(g, seq);
+        return -1;
+    }
+    sent_one(g, seq, len, now, due);
+    return 0;
+}
+
+// longest datagram this run will send
+int max_len(const struct loadgen *g)
+{
+    int len = g->size > 0 ? g->size : g->hdr_len + 24 + g->trailer;
+
+    for (int i = 0; i < g->nsteps; i++)
+        if (g->steps[i].size > len)
+            len = g->steps[i].size;
+    return len;
+}
+
+// -b: the open-loop sender with one sendmmsg per flow per batch. pacing
+// is per batch: batch j is due at start + j * batch / rate and all of it
+// goes out then, so that is also the intended send time its datagrams
+// are charged from. within a batch the datagrams are grouped by flow,
+// in seq_num order. sendmmsg stops at the first failure on a socket, so
+// what it didn't get to is carried into the next batch, ahead of any new
+// seq_nums for that flow: each flow still sends its seq_nums in order
+// and none is skipped, which the -K key mapping relies on.
+void send_batches(struct loadgen *g, int tfd)
+{
+    struct todo {
+        uint64_t seq, due;
+    };
+    int k = g->batch, slot = max_len(g), ntodo = 0, step = 0;
+    char *bufs = calloc(k, slot);
+    struct mmsghdr *msgs = calloc(k, sizeof *msgs);
+    struct iovec *iovs = calloc(k, sizeof *iovs);
+    struct todo *todo = calloc(k, sizeof *todo), *order = calloc(k, sizeof *order);
+    uint32_t *seqs = calloc(k, sizeof *seqs);
+    int at[MAXFLOWS + 1];
+    uint64_t total = g->count * (g->nsteps > 0 ? g->nsteps : 1);
+    uint64_t next = 1, base = g->start_ns, ts_us;
+
+    if (bufs == NULL || msgs == NULL || iovs == NULL || todo == NULL || order == NULL ||
+        seqs == NULL) {
+        perror("client: malloc");
+        exit(1);
+    }
+
+    for (uint64_t i = 0; (total == 0 || next <= total || ntodo > 0) && !stop; i += k) {
+        uint64_t due = 0, now;
+        int n = 0;
+
+        if (ntodo == 0 && g->nsteps > 0 && step_of(g, next) != step) {
+            step = step_of(g, next);
+            base = now_ns() + (uint64_t)STEP_GAP_MS * 1000000;
+            i = 0;
+        }
+        if (g->rate > 0) {
+            due = base + (uint64_t)(i * 1e9 / g->rate);
+            wait_until(tfd, due, g->spin_ns);
+        }
+        // top up with new seq_nums, but never past the end of a sweep step
+        while (ntodo < k && (total == 0 || next <= total) &&
+               (g->nsteps == 0 || step_of(g, next) == step)) {
+            todo[ntodo].seq = next++;
+            todo[ntodo++].due = due;
+        }
+
+        // group by flow (a stable counting sort)
+        memset(at, 0, sizeof at);
+        for (int j = 0; j < ntodo; j++)
+            at[flow_of(&g->sched, todo[j].seq) + 1]++;
+        for (int f = 0; f < g->nflows; f++)
+            at[f + 1] += at[f];
+        for (int j = 0; j < ntodo; j++)
+            order[at[flow_of(&g->sched, todo[j].seq)]++] = todo[j];
+
+        now = now_ns();
+        ts_us = get_time_ms();
+        for (int j = 0; j < ntodo; j++) {
+            char *buf = bufs + (size_t)j * slot;
+            iovs[j].iov_base = buf;
+            // a flow's messages are built in the order they go out, which
+            // the compact header's syncs depend on
+            iovs[j].iov_len = g->compact ? build_compact(g, buf, order[j].seq, ts_us)
+                                         : build_body(g, buf, order[j].seq);
+            msgs[j].msg_hdr.msg_iov = &iovs[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+            seqs[j] = order[j].seq;
+            ring_put(g, order[j].seq, now, order[j].due ? order[j].due : now);
+        }
+        if (!g->compact)
+            proto_stamp_batch(msgs, ntodo, seqs, ts_us);
+        if (g->trailer)
+            proto_crc_seal_batch(msgs, ntodo);
+        __atomic_store_n(&g->seq_hi, next - 1, __ATOMIC_RELEASE);
+
+        // at[f] is now where flow f's run ends
+        for (int f = 0, from = 0; f < g->nflows; from = at[f], f++) {
+            int run = at[f] - from, done = 0;
+
+            if (run > 0 && (done = sendmmsg(g->flows[f].fd, msgs + from, run, 0)) == -1)
+                done = 0;
+            for (int j = from; j < from + done; j++)
+                sent_one(g, order[j].seq, iovs[j].iov_len, now, order[j].due);
+            for (int j = from + done; j < at[f]; j++) {
+                send_failed(g, order[j].seq);
+                todo[n++] = order[j];
+            }
+        }
+        ntodo = n;
+    }
+
+    free(bufs);
+    free(msgs);
+    free(iovs);
+    free(todo);
+    free(order);
+    free(seqs);
+}
+
+// open-loop sender: slot k is due at start + k/rate, computed from the
+// start every time so oversleeping one slot never shifts the rest. a
+// sender that falls behind sends back to back until it has caught up,
+// so the offered load over the run is what was asked for. a failed send
+// gives up its slot but not its seq_num, so seq_nums stay contiguous.
+void send_paced(struct loadgen *g, int tfd)
+{
+    char send_buf[MAXBUFLEN];
+    uint64_t seq = 1, base = g->start_ns, total = g->count * (g->nsteps > 0 ? g->nsteps : 1);
+    int step = 0;
+
+    memset(send_buf, 0, sizeof send_buf);
+    for (uint64_t i = 0; (total == 0 || seq <= total) && !stop; i++) {
+        uint64_t due = 0;
+
+        // each size of a sweep gets its own schedule, after a pause so the
+        // previous size's queues have drained
+        if (g->nsteps > 0 && step_of(g, seq) != step) {
+            step = step_of(g, seq);
+            base = now_ns() + (uint64_t)STEP_GAP_MS * 1000000;
+            i = 0;
+        }
+        if (g->rate > 0) {
+            due = base + (uint64_t)(i * 1e9 / g->rate);
+            pace_until(g, tfd, due);
+        }
+        if (send_one(g, send_buf, seq, due) == 0)
+            seq++;
+    }
+}
+
+// -p: send what a -t trace sent, in the same order and with the same
+// sizes and flows (flow ids past -f wrap around), each due at its time in
+// the trace divided by -x. a failed send gives up its record, not its
+// seq_num, as in send_paced. the trace is read straight from the mapping
+// as it goes, so its length doesn't matter.
+void send_replay(struct loadgen *g, int tfd)
+{
+    char send_buf[MAXBUFLEN];
+    struct trace_rec r;
+    uint64_t seq = 1, first = 0;
+    int rv, started = 0;
+
+    memset(send_buf, 0, sizeof send_buf);
+    while (!stop && (rv = trace_next(g->replay, &r)) == 1) {
+        struct traced *t = &g->sched.replay[seq & (WINDOW - 1)];
+        uint64_t due;
+
+        if (r.dir != TRACE_SENT)
+            continue;
+        if (!started) {
+            first = r.t_ns;
+            started = 1;
+        }
+        t->size = r.size > MAXBUFLEN ? MAXBUFLEN : r.size;
+        if (g->mtu > 0 && t->size > g->mtu)
+            t->size = g->mtu;
+        if (g->compact && t->size >= PROTO_COMPACT_LIMIT)
+            t->size = PROTO_COMPACT_LIMIT - 1;
+        if (t->size < g->hdr_len + g->trailer)
+            t->size = g->hdr_len + g->trailer;
+        t->flow = r.flow % g->nflows;
+        due = g->start_ns + (uint64_t)((r.t_ns - first) / g->speed);
+        pace_until(g, tfd, due);
+        if (send_one(g, send_buf, seq, due) == 0)
+            seq++;
+    }
+    if (rv == -1)
+        fprintf(stderr, "client: trace is cut short or corrupt, stopped after %llu sends\n",
+                (unsigned long long)(seq - 1));
+}
+
+void *sender_main(void *arg)
+{
+    struct loadgen *g = arg;
+    uint64_t total = g->count * (g->nsteps > 0 ? g->nsteps : 1);
+    int tfd;
+
+    if ((tfd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+        perror("timerfd_create");
+        exit(1);
+    }
+    // the default 50 us timer slack would be most of a slot at high rates
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    if (g->replay != NULL)
+        printf("Sender: replaying a trace at %gx its recorded pace\n", g->speed);
+    else if (total > 0 && g->rate > 0)
+        printf("Sender: starting to send numbers 1 to %llu at %.0f pps\n",
+               (unsigned long long)total, g->rate);
+    else if (total > 0)
+        printf("Sender: starting to send numbers 1 to %llu as fast as possible\n",
+               (unsigned long long)total);
+    else
+        printf("Sender: sending at %.0f pps until interrupted\n", g->rate);
+    if (g->batch > 1)
+        printf("Sender: %d datagrams per sendmmsg\n", g->batch);
+    if (g->mtu > 0)
+        printf("Sender: packing messages into datagrams of up to %d bytes, held at most %.0f us\n",
+               g->mtu, g->flush_ns / 1e3);
+    fflush(stdout);
+
+    __atomic_store_n(&g->start_ns, now_ns(), __ATOMIC_RELEASE);
+    if (g->replay != NULL)
+        send_replay(g, tfd);
+    else if (g->batch > 1)
+        send_batches(g, tfd);
+    else
+        send_paced(g, tfd);
+    for (int i = 0; i < g->nflows && g->mtu > 0; i++)
+        bundle_flush(g, i);
+    g->end_ns = now_ns();
+
+    printf("Sender: finished sending all numbers\n");
+    fflush(stdout);
+    close(tfd);
+    __atomic_store_n(&g->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// closed loop (-W), run by the receiver between replies: keep the step's
+// window of seq_nums outstanding, so every reply (or loss, once settled)
+// lets the next one go. a window step only starts once the previous one
+// has nothing left in flight. returns once the window is full.
+void pump(struct loadgen *g, const struct seqwin *w, char *buf)
+{
+    uint64_t total = g->count * (g->nsteps > 0 ? g->nsteps : 1);
+
+    while (!g->done) {
+        uint64_t next = g->seq_hi + 1;
+        uint64_t in_flight = next - w->base - w->seen;
+        int window = g->window;
+
+        if (stop || (total > 0 && next > total)) {
+            g->end_ns = now_ns();
+            printf("Sender: finished sending all numbers\n");
+            fflush(stdout);
+            g->done = 1;
+            break;
+        }
+        if (g->nsteps > 0) {
+            window = g->steps[step_of(g, next)].window;
+            if (next > 1 && step_of(g, next) != step_of(g, next - 1) && in_flight > 0)
+                break;
+        }
+        if (in_flight >= (uint64_t)window || send_one(g, buf, next, 0) == -1)
+            break;
+    }
+}
+
+void rxcount_add(struct rxcount *dst, const struct rxcount *src)
+{
+    dst->received += src->received;
+    dst->lost += src->lost;
+    dst->late += src->late;
+    dst->dups += src->dups;
+    dst->reordered += src->reordered;
+    dst->reorder_sum += src->reorder_sum;
+    if (src->reorder_max > dst->reorder_max)
+        dst->reorder_max = src->reorder_max;
+    dst->stray += src->stray;
+    dst->truncated += src->truncated;
+    dst->corrupt += src->corrupt;
+    dst->unsynced += src->unsynced;
+}
+
+// count one seq_num's outcome against its flow and, in a sweep, its size
+void rx_count(struct loadgen *g, uint64_t seq, const struct rxcount *d)
+{
+    rxcount_add(&g->flows[flow_of(&g->sched, seq)].ivl, d);
+    if (g->nsteps > 0)
+        rxcount_add(&g->steps[step_of(g, seq)].c, d);
+}
+
+// everything below upto has had its chance: count what never came back,
+// against the flow (and sweep size) each seq_num went out on
+void seqwin_settle(struct seqwin *w, struct loadgen *g, uint64_t upto)
+{
+    while (w->base < upto) {
+        uint64_t *word = &w->bits[(w->base / 64) % (WINDOW / 64)];
+        unsigned bit = w->base % 64;
+
+        if (bit == 0 && upto - w->base >= 64 && g->nflows == 1 && g->nsteps == 0) {
+            unsigned got = __builtin_popcountll(*word);
+            g->flows[0].ivl.lost += 64 - got;
+            w->seen -= got;
+            *word = 0;
+            w->base += 64;
+            continue;
+        }
+        if (*word >> bit & 1) {
+            w->seen--;
+            *word &= ~(1ULL << bit);
+        } else {
+            struct rxcount d = { .lost = 1 };
+            rx_count(g, w->base, &d);
+        }
+        w->base++;
+    }
+}
+
+// account one reply. returns 1 for the first reply to a seq_num still in
+// the window, 0 for a duplicate and -1 for one that was already settled.
+// below the window there are no bits left to tell a late reply from a
+// late copy of one that made it, so neither is taken back off lost.
+// reordering is judged within the seq_num's own flow: the flows take
+// different paths through the NIC queues and the server's workers, so
+// interleaving between them isn't reordering.
+int seqwin_add(struct seqwin *w, struct loadgen *g, uint64_t seq)
+{
+    struct flow *f = &g->flows[flow_of(&g->sched, seq)];
+    struct rxcount d = {0};
+    uint64_t *word;
+    uint64_t bit;
+
+    if (seq < w->base) {
+        d.late = 1;
+        rx_count(g, seq, &d);
+        return -1;
+    }
+    // too far ahead: the oldest seq_nums have to be settled to make room
+    if (seq >= w->base + WINDOW)
+        seqwin_settle(w, g, seq - WINDOW + 1);
+
+    word = &w->bits[(seq / 64) % (WINDOW / 64)];
+    bit = 1ULL << (seq % 64);
+    if (*word & bit) {
+        d.dups = 1;
+        rx_count(g, seq, &d);
+        return 0;
+    }
+    *word |= bit;
+    w->seen++;
+    d.received = 1;
+
+    if (seq > w->max)
+        w->max = seq;
+    if (seq < f->max_seq) {
+        d.reordered = 1;
+        d.reorder_sum = d.reorder_max = f->max_seq - seq;
+    } else {
+        f->max_seq = seq;
+    }
+    rx_count(g, seq, &d);
+    return 1;
+}
+
+// settle every seq_num sent more than DRAIN_MS ago. a slot that has been
+// reused belongs to a seq_num far older than that.
+void settle_expired(struct loadgen *g, struct seqwin *w, uint64_t now)
+{
+    uint64_t hi = __atomic_load_n(&g->seq_hi, __ATOMIC_ACQUIRE);
+    uint64_t sent_ns, due_ns;
+
+    while (w->base <= hi) {
+        if (ring_get(g, w->base, &sent_ns, &due_ns) &&
+            sent_ns + (uint64_t)DRAIN_MS * 1000000 > now)
+            break;
+        seqwin_settle(w, g, w->base + 1);
+    }
+}
+
+// the wire carries the low 32 bits of a seq_num; take the 64-bit value
+// nearest to the highest one seen so far
+uint64_t seq_widen(uint32_t wire, uint64_t ref)
+{
+    return ref + (int32_t)(wire - (uint32_t)ref);
+}
+
+// ring slot for seq, cleared if it still holds an older seq_num
+struct kslot *kslot_get(struct kslot *ring, uint64_t seq)
+{
+    struct kslot *k = &ring[seq & (WINDOW - 1)];
+
+    if (k->seq != seq) {
+        memset(k, 0, sizeof *k);
+        k->seq = seq;
+    }
+    return k;
+}
+
+// record whichever kernel RTTs k now has both ends of. the two stamps
+// come from the same clock, so the difference is valid even though the
+// user space RTT is on CLOCK_MONOTONIC.
+void kslot_check(struct kslot *k, struct kstats *ks)
+{
+    if (!(k->done & KS_SW) && k->tx.sw && k->rx.sw && k->rx.sw >= k->tx.sw) {
+        uint64_t rtt = k->rx.sw - k->tx.sw;
+        hist_add(&ks->sw, rtt, 1);
+        hist_add(&ks->host, k->user_ns > rtt ? k->user_ns - rtt : 0, 1);
+        k->done |= KS_SW;
+    }
+    if (!(k->done & KS_HW) && k->tx.hw && k->rx.hw && k->rx.hw >= k->tx.hw) {
+        hist_add(&ks->hw, k->rx.hw - k->tx.hw, 1);
+        k->done |= KS_HW;
+    }
+}
+
+// drain the TX stamps queued so far on flow fl, or on all of them for -1.
+// failed sends don't use up a key, so key n is the flow's nth successful
+// send. keys are 32 bits, widened against about where the flow is now.
+void kstamp_drain(const struct loadgen *g, struct kslot *ring, struct kstats *ks, int fl)
+{
+    uint64_t hi = __atomic_load_n(&g->seq_hi, __ATOMIC_ACQUIRE);
+    struct kstamp tx;
+    uint32_t key;
+
+    for (int f = fl < 0 ? 0 : fl; f < (fl < 0 ? g->nflows : fl + 1); f++) {
+        uint64_t near = hi * g->sched.per_cycle[f] / g->sched.len;
+
+        while (tstamp_tx(g->flows[f].fd, &key, &tx) == 1) {
+            struct kslot *k = kslot_get(ring, sched_seq(&g->sched, f, seq_widen(key, near)));
+
+            if (tx.sw && !k->tx.sw) {
+                k->tx.sw = tx.sw;
+                ks->tx_stamps++;
+            }
+            if (tx.hw)
+                k->tx.hw = tx.hw;
+            kslot_check(k, ks);
+        }
+    }
+}
+
+// next reply from any flow, with *fl set to the flow it came in on. a
+// single flow just blocks in recvmsg until SO_RCVTIMEO. with several,
+// the ones poll last reported readable are read without blocking, taking
+// turns so a busy flow can't starve the rest, and poll is only called
+// again once they are all drained. returns -1 with *fl = -1 on a timeout
+// or when a socket has something on its error queue.
+int recv_any(struct loadgen *g, struct msghdr *msg, int *fl)
+{
+    struct pollfd pfd[MAXFLOWS];
+    int err = 0;
+
+    *fl = 0;
+    if (g->nflows == 1)
+        return recvmsg(g->flows[0].fd, msg, 0);
+
+    while (g->rx_ready != 0) {
+        for (int i = 0; i < g->nflows; i++) {
+            int f = (g->rx_next + i) % g->nflows;
+            int n;
+
+            if (!(g->rx_ready >> f & 1))
+                continue;
+            if ((n = recvmsg(g->flows[f].fd, msg, MSG_DONTWAIT)) >= 0) {
+                g->rx_next = f + 1;
+                *fl = f;
+                return n;
+            }
+            g->rx_ready &= ~(1ULL << f);
+        }
+    }
+
+    *fl = -1;
+    for (int i = 0; i < g->nflows; i++) {
+        pfd[i].fd = g->flows[i].fd;
+        pfd[i].events = POLLIN;
+    }
+    if (poll(pfd, g->nflows, 100) <= 0)
+        return -1;
+    for (int i = 0; i < g->nflows; i++) {
+        if (pfd[i].revents & (POLLIN | POLLERR))
+            g->rx_ready |= 1ULL << i;
+        if (pfd[i].revents & POLLERR)
+            err = 1;
+    }
+    return err ? -1 : recv_any(g, msg, fl);
+}
+
+void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+// -k: offer the compact header to the server with a hello on fd, a few
+// times in case one is lost. returns the version it accepted, 0 if it
+// echoed the hello back unanswered or never at all.
+int negotiate(int fd)
+{
+    char buf[PROTO_HELLO_LEN], reply[MAXBUFLEN];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int n;
+
+    for (int tries = 0; tries < 3; tries++) {
+        proto_hello_init(buf, get_time_ms());
+        if (send(fd, buf, sizeof buf, 0) == -1)
+            continue;
+        while (poll(&pfd, 1, 200) == 1) {
+            if ((n = recv(fd, reply, sizeof reply, 0)) >= 0 && proto_is_hello(reply, n))
+                return proto_hello_accepted(reply);
+        }
+    }
+    return 0;
+}
+
+// -y: a reliable transfer of -n messages under congestion control. every
+// message is kept until it is acked, and one found lost is sent again
+// ahead of new ones while the rest keep going, so a loss costs its own
+// retransmission instead of stalling everything behind it.
+//
+// a loss is found RACK-style: once a message sent later has been acked
+// and this one is still out a reordering window past the RTT, it is
+// gone. a timeout (RFC 6298) catches the rest, e.g. the last few of a
+// transfer.
+
+enum { RP_OUT = 1, RP_LOST, RP_ACKED };
+
+// the latest transmission of a seq_num, in a ring of WINDOW slots
+struct rpkt {
+    uint64_t seq;
+    uint64_t sent_ns;
+    uint64_t ts_us;        // its header timestamp, which the ack echoes
+    uint64_t delivered;    // the transfer's delivered count when it was sent
+    uint64_t delivered_ns; // and when that last went up
+    int len;
+    int state;
+    int copies;            // transmissions so far
+};
+
+// one transmission, queued in sending order for loss detection. it is
+// stale once its seq_num has been acked or sent again.
+struct rsent {
+    uint64_t seq, sent_ns;
+};
+
+struct transfer {
+    struct cc cc;
+    struct rpkt *pkts;       // WINDOW
+    struct rsent *fifo;      // WINDOW, head..tail
+    uint64_t head, tail;
+    uint64_t *lostq;         // WINDOW, lhead..ltail: seq_nums to send again
+    uint64_t lhead, ltail;
+    uint64_t next_seq;       // next new seq_num
+    uint64_t una;            // oldest seq_num not acked yet
+    uint64_t inflight;
+    uint64_t delivered, delivered_ns, bytes;
+    uint64_t srtt, rttvar, rto, min_rtt; // ns
+    int backoff;
+    uint64_t rack_sent, rack_rtt; // the newest transmission acked: when it went, its RTT
+    uint64_t next_send_ns;   // pacing
+    uint64_t rng;
+    double tx_loss, rx_loss; // -L
+    uint64_t sent, retrans, lost_fast, lost_rto, timeouts, spurious, acks;
+    uint64_t dropped_tx, dropped_rx, send_errors, corrupt, stray;
+    struct hist rtt;
+};
+
+#define RTO_INIT_NS 200000000ULL
+#define RTO_MIN_NS 10000000ULL
+#define RTO_MAX_NS 1000000000ULL
+#define MAX_BACKOFF 6
+#define XFER_SPIN_NS 20000   // wait shorter than this by spinning, not in ppoll
+
+static inline struct rpkt *xfer_pkt(struct transfer *t, uint64_t seq)
+{
+    struct rpkt *p = &t->pkts[seq & (WINDOW - 1)];
+    return p->seq == seq ? p : NULL;
+}
+
+// -L: a coin that comes up heads pct percent of the time (xorshift64)
+int xfer_drop(struct transfer *t, double pct)
+{
+    if (pct <= 0)
+        return 0;
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return (t->rng >> 11) * 0x1p-53 * 100 < pct;
+}
+
+// the next seq_num to send: a lost one first, else a new one if the
+// transfer has more and the ring room for it; 0 if neither
+uint64_t xfer_next(struct transfer *t, const struct loadgen *g)
+{
+    while (t->lhead != t->ltail) {
+        uint64_t seq = t->lostq[t->lhead++ & (WINDOW - 1)];
+        struct rpkt *p = xfer_pkt(t, seq);
 
-long long get_time_ms() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (long long)(tv.tv_sec * 1000000 + tv.tv_usec);
+        if (p != NULL && p->state == RP_LOST)
+            return seq;
+    }
+    if ((g->count == 0 || t->next_seq <= g->count) && t->next_seq - t->una < WINDOW)
+        return t->next_seq;
+    return 0;
+}
+
+void xfer_send(struct transfer *t, struct loadgen *g, char *buf, uint64_t seq, uint64_t now)
+{
+    struct rpkt *p = &t->pkts[seq & (WINDOW - 1)];
+    int len = build_one(g, buf, seq);
+
+    if (seq == t->next_seq) {
+        memset(p, 0, sizeof *p);
+        p->seq = seq;
+        t->next_seq++;
+    }
+    // an idle spell isn't part of the next rate sample
+    if (t->inflight == 0)
+        t->delivered_ns = now;
+    p->sent_ns = now;
+    p->ts_us = proto_timestamp(buf);
+    p->delivered = t->delivered;
+    p->delivered_ns = t->delivered_ns;
+    p->len = len;
+    p->state = RP_OUT;
+    t->retrans += p->copies++ > 0;
+    t->inflight++;
+    t->fifo[t->tail++ & (WINDOW - 1)] = (struct rsent){ seq, now };
+    t->sent++;
+
+    if (xfer_drop(t, t->tx_loss))
+        t->dropped_tx++;
+    else if (send(g->flows[0].fd, buf, len, 0) == -1)
+        t->send_errors++; // as good as lost; found the same way
+}
+
+void xfer_lose(struct transfer *t, struct rpkt *p)
+{
+    p->state = RP_LOST;
+    t->inflight--;
+    t->lostq[t->ltail++ & (WINDOW - 1)] = p->seq;
+}
+
+// newly acked: 1 if seq was still waiting for one
+int xfer_deliver(struct transfer *t, uint64_t seq, uint64_t now)
+{
+    struct rpkt *p;
+
+    if (seq < t->una || seq >= t->next_seq || (p = xfer_pkt(t, seq)) == NULL ||
+        p->state == RP_ACKED)
+        return 0;
+    if (p->state == RP_OUT)
+        t->inflight--;
+    p->state = RP_ACKED;
+    t->delivered++;
+    t->delivered_ns = now;
+    t->bytes += p->len;
+    // only a message sent once says for sure which transmission arrived
+    if (p->copies == 1 && p->sent_ns > t->rack_sent) {
+        t->rack_sent = p->sent_ns;
+        t->rack_rtt = now - p->sent_ns;
+    }
+    return 1;
+}
+
+void xfer_rtt(struct transfer *t, uint64_t r)
+{
+    if (t->srtt == 0) {
+        t->srtt = r;
+        t->rttvar = r / 2;
+    } else {
+        uint64_t d = r > t->srtt ? r - t->srtt : t->srtt - r;
+        t->rttvar = (3 * t->rttvar + d) / 4;
+        t->srtt = (7 * t->srtt + r) / 8;
+    }
+    t->rto = t->srtt + 4 * t->rttvar;
+    if (t->rto < RTO_MIN_NS)
+        t->rto = RTO_MIN_NS;
+    if (t->rto > RTO_MAX_NS)
+        t->rto = RTO_MAX_NS;
+    if (t->min_rtt == 0 || r < t->min_rtt)
+        t->min_rtt = r;
+    hist_add(&t->rtt, r, 1);
+}
+
+void xfer_ack(struct transfer *t, const char *m, size_t n, uint64_t now)
+{
+    uint64_t seq, max, window, before = t->delivered;
+    struct cc_ack a = { .now_ns = now };
+    struct rpkt *p;
+    int timed = 0;
+
+    if (!proto_is_ack(m, n)) {
+        t->stray++;
+        return;
+    }
+    t->acks++;
+    seq = seq_widen(proto_seq(m), t->una);
+    max = seq_widen(proto_ack_max(m), t->una);
+    window = proto_ack_window(m);
+
+    // the timestamp tells which transmission this answers. the RTT and
+    // the rate are only measured on the latest one, and an ack of an
+    // earlier one means sending it again was a mistake.
+    if ((p = xfer_pkt(t, seq)) != NULL && seq >= t->una) {
+        if (p->ts_us == proto_timestamp(m)) {
+            timed = 1;
+            a.rtt_ns = now - p->sent_ns;
+            xfer_rtt(t, a.rtt_ns);
+            if (p->sent_ns > t->rack_sent) {
+                t->rack_sent = p->sent_ns;
+                t->rack_rtt = a.rtt_ns;
+            }
+        } else if (p->copies > 1 && p->state != RP_ACKED) {
+            t->spurious++;
+        }
+    }
+    xfer_deliver(t, seq, now);
+    for (int i = 0; i < ACK_WINDOW && max >= (uint64_t)i; i++)
+        if (window >> i & 1)
+            xfer_deliver(t, max - i, now);
+    while (t->una < t->next_seq && (p = xfer_pkt(t, t->una)) != NULL && p->state == RP_ACKED)
+        t->una++;
+
+    if (t->delivered == before)
+        return;
+    t->backoff = 0;
+    a.acked = t->delivered - before;
+    a.inflight = t->inflight;
+    a.delivered = t->delivered;
+    if (timed) {
+        p = xfer_pkt(t, seq);
+        a.prior_delivered = p->delivered;
+        if (now > p->delivered_ns)
+            a.rate = (t->delivered - p->delivered) * 1e9 / (now - p->delivered_ns);
+    }
+    t->cc.ops->on_ack(&t->cc, &a);
+}
+
+// the oldest transmission still out, dropping the stale ones in front of
+// it; NULL if there is none
+struct rsent *xfer_oldest(struct transfer *t)
+{
+    while (t->head != t->tail) {
+        struct rsent *e = &t->fifo[t->head & (WINDOW - 1)];
+        struct rpkt *p = xfer_pkt(t, e->seq);
+
+        if (p != NULL && p->state == RP_OUT && p->sent_ns == e->sent_ns)
+            return e;
+        t->head++;
+    }
+    return NULL;
+}
+
+// mark what RACK says is lost, and return when the next one will be if
+// no more acks come (0 = nothing pending)
+uint64_t xfer_detect(struct transfer *t, uint64_t now)
+{
+    uint64_t reo = t->min_rtt / 4;
+
+    xfer_oldest(t);
+    for (uint64_t i = t->head; i != t->tail; i++) {
+        struct rsent *e = &t->fifo[i & (WINDOW - 1)];
+        struct rpkt *p = xfer_pkt(t, e->seq);
+
+        if (p == NULL || p->state != RP_OUT || p->sent_ns != e->sent_ns)
+            continue;
+        // in sending order, so the first one not overtaken ends it
+        if (e->sent_ns >= t->rack_sent)
+            return 0;
+        if (now < e->sent_ns + t->rack_rtt + reo)
+            return e->sent_ns + t->rack_rtt + reo;
+        xfer_lose(t, p);
+        t->lost_fast++;
+        t->cc.ops->on_loss(&t->cc, now, e->sent_ns);
+    }
+    return 0;
+}
+
+// everything still out is lost
+void xfer_timeout(struct transfer *t, uint64_t now)
+{
+    struct rsent *e;
+
+    while ((e = xfer_oldest(t)) != NULL) {
+        xfer_lose(t, xfer_pkt(t, e->seq));
+        t->lost_rto++;
+        t->head++;
+    }
+    t->timeouts++;
+    if (t->backoff < MAX_BACKOFF)
+        t->backoff++;
+    t->cc.ops->on_rto(&t->cc, now);
+}
+
+void xfer_report(const struct transfer *t, const struct loadgen *g, uint64_t elapsed)
+{
+    double secs = elapsed / 1e9;
+
+    printf("Transfer (%s): %llu messages, %llu bytes in %.3f s: %.2f Mbit/s goodput, "
+           "%.0f msgs/s\n", t->cc.ops->name, (unsigned long long)t->delivered,
+           (unsigned long long)t->bytes, secs, secs > 0 ? t->bytes * 8 / secs / 1e6 : 0,
+           secs > 0 ? t->delivered / secs : 0);
+    if (g->count > 0 && t->delivered < g->count)
+        printf("Transfer interrupted: %llu of %llu messages acked\n",
+               (unsigned long long)t->delivered, (unsigned long long)g->count);
+    printf("Sent %llu transmissions, %llu of them again (%.2f%%); %llu found lost by RACK, "
+           "%llu by %llu timeouts; %llu resent needlessly\n",
+           (unsigned long long)t->sent, (unsigned long long)t->retrans,
+           t->sent > 0 ? 100.0 * t->retrans / t->sent : 0, (unsigned long long)t->lost_fast,
+           (unsigned long long)t->lost_rto, (unsigned long long)t->timeouts,
+           (unsigned long long)t->spurious);
+    if (t->tx_loss > 0 || t->rx_loss > 0)
+        printf("Injected loss: %llu sends, %llu acks dropped\n",
+               (unsigned long long)t->dropped_tx, (unsigned long long)t->dropped_rx);
+    if (t->send_errors > 0)
+        printf("Send errors: %llu (retransmitted)\n", (unsigned long long)t->send_errors);
+    printf("RTT: srtt %.3f ms, min %.3f ms, rto %.3f ms; final cwnd %.1f, pacing ",
+           t->srtt / 1e6, t->min_rtt / 1e6, t->rto / 1e6, t->cc.cwnd);
+    if (t->cc.pacing_rate > 0)
+        printf("%.0f msgs/s\n", t->cc.pacing_rate);
+    else
+        printf("off\n");
+    if (t->rtt.total > 0)
+        hist_print("RTT", &t->rtt);
+    printf("Acks: %llu", (unsigned long long)t->acks);
+    if (g->trailer)
+        printf(", %llu failed the CRC", (unsigned long long)t->corrupt);
+    printf(", %llu not acks\n", (unsigned long long)t->stray);
+}
+
+int transfer_run(struct loadgen *g, const struct cc_ops *ops, double tx_loss, double rx_loss)
+{
+    static struct transfer t;
+    static char buf[MAXBUFLEN], rbuf[MAXBUFLEN];
+    struct pollfd pfd = { g->flows[0].fd, POLLIN, 0 };
+    uint64_t start, now;
+    int fd = g->flows[0].fd, n;
+
+    t.pkts = calloc(WINDOW, sizeof *t.pkts);
+    t.fifo = calloc(WINDOW, sizeof *t.fifo);
+    t.lostq = calloc(WINDOW, sizeof *t.lostq);
+    if (t.pkts == NULL || t.fifo == NULL || t.lostq == NULL) {
+        perror("client: malloc");
+        return 1;
+    }
+    t.next_seq = t.una = 1;
+    t.rto = RTO_INIT_NS;
+    t.tx_loss = tx_loss;
+    t.rx_loss = rx_loss;
+    t.rng = now_ns() | 1;
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    start = now = now_ns();
+    t.delivered_ns = start;
+    cc_init(&t.cc, ops, start);
+    printf("Sender: reliable transfer, %s congestion control", ops->name);
+    if (tx_loss > 0 || rx_loss > 0)
+        printf(", dropping %.2f%% of sends and %.2f%% of acks", tx_loss, rx_loss);
+    printf("\n");
+
+    while (!stop && (g->count == 0 || t.una <= g->count)) {
+        uint64_t wake, rack, deadline = 0;
+        struct rsent *e;
+
+        while ((n = recv(fd, rbuf, sizeof rbuf, MSG_DONTWAIT)) >= 0) {
+            now = now_ns();
+            if (xfer_drop(&t, t.rx_loss)) {
+                t.dropped_rx++;
+                continue;
+            }
+            for (size_t at = 0, len; at < (size_t)n; at += len) {
+                len = proto_next(rbuf + at, n - at);
+                if (g->trailer && proto_crc_check(rbuf + at, len) != CRC_OK)
+                    t.corrupt++;
+                else
+                    xfer_ack(&t, rbuf + at, len, now);
+            }
+        }
+        // an older server echoes data messages back as they are
+        if (t.acks == 0 && t.stray > 0) {
+            fprintf(stderr, "client: the server echoes instead of acking; -y needs a newer server11\n");
+            return 1;
+        }
+        now = now_ns();
+
+        rack = xfer_detect(&t, now);
+        if ((e = xfer_oldest(&t)) != NULL) {
+            deadline = e->sent_ns + (t.rto << t.backoff);
+            if (now >= deadline) {
+                xfer_timeout(&t, now);
+                deadline = 0;
+            }
+        }
+
+        // as much as the window, the pacing and the ring allow
+        while (t.inflight < t.cc.cwnd && t.inflight < WINDOW / 2 &&
+               t.tail - t.head < WINDOW && now >= t.next_send_ns) {
+            uint64_t seq = xfer_next(&t, g);
+
+            if (seq == 0)
+                break;
+            xfer_send(&t, g, buf, seq, now);
+            if (t.cc.pacing_rate > 0)
+                t.next_send_ns = (t.next_send_ns > now ? t.next_send_ns : now) +
+                                 1e9 / t.cc.pacing_rate;
+            if (deadline == 0)
+                deadline = now + (t.rto << t.backoff);
+            now = now_ns();
+        }
+
+        // until an ack, the timeout, a RACK deadline or the next paced send
+        wake = deadline;
+        if (rack != 0 && (wake == 0 || rack < wake))
+            wake = rack;
+        if (t.next_send_ns > now && t.inflight < t.cc.cwnd && (wake == 0 || t.next_send_ns < wake))
+            wake = t.next_send_ns;
+        if (wake == 0 || wake > now + XFER_SPIN_NS) {
+            uint64_t d = wake == 0 ? 100000000 : wake - now;
+            struct timespec ts = { d / 1000000000, d % 1000000000 };
+            ppoll(&pfd, 1, &ts, NULL);
+        }
+    }
+
+    xfer_report(&t, g, now_ns() - start);
+    return 0;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "usage: client11c [-T] [-K] [-c] [-r pps] [-n count] [-s spin_us] [-i secs]\n");
+    fprintf(stderr, "                 [-H file] [-A file]... [-f flows] [-w weight,...] [-J file]\n");
+    fprintf(stderr, "                 [-C file]");
+    fprintf(stderr, " [-B file [-X lat_pct[:tput_pct]]] [-l bytes | -z min:max[:factor]]\n");
+    fprintf(stderr, "                 [-W window,...] [-b batch|auto] [-t file] [-p file [-x speed]]\n");
+    fprintf(stderr, "                 [-m bytes[:flush_us]] [-k resync] [-y aimd|bbr [-L pct[:ack_pct]]]\n");
+    fprintf(stderr, "                 hostname\n");
+    fprintf(stderr, "  -T  ask a server11 -R for receive/transmit timestamps\n");
+    fprintf(stderr, "  -K  also measure RTT from kernel (SO_TIMESTAMPING) send/receive stamps\n");
+    fprintf(stderr, "  -c  end every datagram with a CRC32C and check it on the echo\n");
+    fprintf(stderr, "  -r  target send rate in datagrams per second (default 1000, 0 = as fast\n");
+    fprintf(stderr, "      as possible)\n");
+    fprintf(stderr, "  -n  datagrams to send (default 10000, 0 = until ctrl-c)\n");
+    fprintf(stderr, "  -s  spin for the last spin_us before each send instead of sleeping\n");
+    fprintf(stderr, "      (default 0; tightens pacing at the cost of a busy core)\n");
+    fprintf(stderr, "  -i  print loss, reordering and RTT every secs\n");
+    fprintf(stderr, "  -H  save this run's latency histograms to file\n");
+    fprintf(stderr, "  -A  also report histograms merged with those saved in file (up to %d)\n", MAXMERGE);
+    fprintf(stderr, "  -f  send from this many sockets, each with its own source port (up to %d)\n", MAXFLOWS);
+    fprintf(stderr, "  -w  split the sends between the flows in these proportions (default\n");
+    fprintf(stderr, "      round-robin; one weight per flow, total at most %d)\n", SCHEDMAX);
+    fprintf(stderr, "  -J  write per-interval and total counts, rates and RTT percentiles to\n");
+    fprintf(stderr, "      file as JSON (every -i secs, default 1)\n");
+    fprintf(stderr, "  -C  the same as CSV\n");
+    fprintf(stderr, "  -B  compare the run with a baseline written by -J; exit %d if it regressed\n",
+            BASELINE_EXIT);
+    fprintf(stderr, "  -X  allowed RTT percentile increase and throughput drop, %% (default 10:5)\n");
+    fprintf(stderr, "  -b  send batch datagrams per sendmmsg, pacing whole batches; auto picks\n");
+    fprintf(stderr, "      a batch every %d us at the target rate (up to %d)\n", BATCH_US, MAXSEND);
+    fprintf(stderr, "  -W  closed loop: keep window datagrams outstanding, sending the next one\n");
+    fprintf(stderr, "      as each reply comes back (-r is ignored); a list runs -n datagrams\n");
+    fprintf(stderr, "      at each window in turn, for a latency/throughput curve\n");
+    fprintf(stderr, "  -l  pad (or cut) every datagram to this many bytes, header included\n");
+    fprintf(stderr, "  -z  sweep datagram sizes from min to max bytes, multiplying by factor\n");
+    fprintf(stderr, "      (default 2), sending -n datagrams at each; max up to %d\n", MAXBUFLEN);
+    fprintf(stderr, "  -t  record every datagram sent and received to file, as a trace\n");
+    fprintf(stderr, "  -p  replay the sends in a -t trace: same gaps, sizes and flows\n");
+    fprintf(stderr, "      (-n, -r and -b don't apply)\n");
+    fprintf(stderr, "  -x  replay speed, e.g. 2 for twice as fast as recorded (default 1)\n");
+    fprintf(stderr, "  -m  pack messages on a flow into datagrams of up to bytes, sending each\n");
+    fprintf(stderr, "      once full or flush_us after its first message (default %d)\n", FLUSH_US);
+    fprintf(stderr, "  -k  offer the server the compact header: seq_num and timestamp as\n");
+    fprintf(stderr, "      varints relative to a full sync every resync messages per flow\n");
+    fprintf(stderr, "  -y  reliable transfer of -n messages: acked, resent when lost, under\n");
+    fprintf(stderr, "      aimd (Reno-style) or bbr (BBR-like) congestion control (-r is ignored)\n");
+    fprintf(stderr, "  -L  drop pct%% of the transfer's sends and ack_pct%% (default pct) of\n");
+    fprintf(stderr, "      its acks on purpose, to exercise recovery\n");
+    exit(1);
+}
+
+// one -J/-C record: an interval, or the whole run
+struct row {
+    double from, to;     // s since the first send
+    uint64_t sent, received, lost, late, dups, reordered;
+    double sent_pps, recv_pps, loss_pct;
+    double p50, p90, p99, p999, max; // RTT, ms
+};
+
+void row_fill(struct row *r, const struct rxcount *c, uint64_t sent, const struct hist *rtt,
+              double from, double to)
+{
+    double secs = to > from ? to - from : 0;
+
+    r->from = from;
+    r->to = to;
+    r->sent = sent;
+    r->received = c->received;
+    r->lost = c->lost;
+    r->late = c->late;
+    r->dups = c->dups;
+    r->reordered = c->reordered;
+    r->sent_pps = secs > 0 ? sent / secs : 0;
+    r->recv_pps = secs > 0 ? c->received / secs : 0;
+    r->loss_pct = c->received + c->lost ? 100.0 * c->lost / (c->received + c->lost) : 0;
+    r->p50 = hist_pct(rtt, 0.5) / 1e6;
+    r->p90 = hist_pct(rtt, 0.9) / 1e6;
+    r->p99 = hist_pct(rtt, 0.99) / 1e6;
+    r->p999 = hist_pct(rtt, 0.999) / 1e6;
+    r->max = rtt->max / 1e6;
+}
+
+#define CSV_HEADER "interval,from_s,to_s,sent,received,lost,late,dup,reordered," \
+                   "sent_pps,recv_pps,loss_pct,rtt_p50_ms,rtt_p90_ms,rtt_p99_ms," \
+                   "rtt_p999_ms,rtt_max_ms\n"
+
+// label is the interval number, or "total" for the summary row
+void row_csv(FILE *f, const char *label, const struct row *r)
+{
+    fprintf(f, "%s,%.3f,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%.1f,%.1f,%.4f,"
+            "%.6f,%.6f,%.6f,%.6f,%.6f\n", label, r->from, r->to,
+            (unsigned long long)r->sent, (unsigned long long)r->received,
+            (unsigned long long)r->lost, (unsigned long long)r->late,
+            (unsigned long long)r->dups, (unsigned long long)r->reordered,
+            r->sent_pps, r->recv_pps, r->loss_pct, r->p50, r->p90, r->p99, r->p999, r->max);
+    fflush(f);
+}
+
+void row_json(FILE *f, const struct row *r)
+{
+    fprintf(f, "{\"from_s\": %.3f, \"to_s\": %.3f, \"sent\": %llu, \"received\": %llu, "
+            "\"lost\": %llu, \"late\": %llu, \"dup\": %llu, \"reordered\": %llu, "
+            "\"sent_pps\": %.1f, \"recv_pps\": %.1f, \"loss_pct\": %.4f, "
+            "\"rtt_p50_ms\": %.6f, \"rtt_p90_ms\": %.6f, \"rtt_p99_ms\": %.6f, "
+            "\"rtt_p999_ms\": %.6f, \"rtt_max_ms\": %.6f}", r->from, r->to,
+            (unsigned long long)r->sent, (unsigned long long)r->received,
+            (unsigned long long)r->lost, (unsigned long long)r->late,
+            (unsigned long long)r->dups, (unsigned long long)r->reordered,
+            r->sent_pps, r->recv_pps, r->loss_pct, r->p50, r->p90, r->p99, r->p999, r->max);
+    fflush(f);
+}
+
+// number after "key": in the "summary" object of a -J file, NAN if absent.
+// only has to read back what row_json writes, not JSON in general.
+double json_summary(const char *doc, const char *key)
+{
+    char pat[64];
+    const char *at = strstr(doc, "\"summary\"");
+
+    if (at == NULL)
+        return NAN;
+    snprintf(pat, sizeof pat, "\"%s\":", key);
+    if ((at = strstr(at, pat)) == NULL)
+        return NAN;
+    return strtod(at + strlen(pat), NULL);
+}
+
+// -B: hold this run's summary against a saved -J file. latency may grow
+// by lat_pct and throughput drop by tput_pct before it counts. loss is in
+// percentage points, since a baseline of 0% loss has no ratio to take.
+// returns the number of regressions.
+int baseline_check(const char *path, const struct row *r, double lat_pct, double tput_pct)
+{
+    struct {
+        const char *key;
+        double now;
+        int higher_worse;
+        double limit;  // allowed change, % (or points for loss)
+    } m[] = {
+        { "recv_pps", r->recv_pps, 0, tput_pct },
+        { "loss_pct", r->loss_pct, 1, tput_pct },
+        { "rtt_p50_ms", r->p50, 1, lat_pct },
+        { "rtt_p99_ms", r->p99, 1, lat_pct },
+        { "rtt_p999_ms", r->p999, 1, lat_pct },
+    };
+    char *doc;
+    long len;
+    int bad = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    if ((doc = malloc(len + 1)) == NULL || fread(doc, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(f);
+        free(doc);
+        return -1;
+    }
+    doc[len] = '\0';
+    fclose(f);
+
+    printf("Against baseline %s (latency +%.1f%%, throughput -%.1f%% allowed):\n",
+           path, lat_pct, tput_pct);
+    for (size_t i = 0; i < sizeof m / sizeof m[0]; i++) {
+        double base = json_summary(doc, m[i].key);
+        double change;
+        int worse;
+
+        if (isnan(base)) {
+            printf("  %-12s missing from baseline\n", m[i].key);
+            continue;
+        }
+        if (strcmp(m[i].key, "loss_pct") == 0)
+            change = m[i].now - base;
+        else
+            change = base > 0 ? 100 * (m[i].now - base) / base : 0;
+        worse = m[i].higher_worse ? change > m[i].limit : -change > m[i].limit;
+        bad += worse;
+        printf("  %-12s baseline %12.4f, now %12.4f, %+8.2f%s %s\n", m[i].key, base,
+               m[i].now, change, strcmp(m[i].key, "loss_pct") == 0 ? " pt" : "% ",
+               worse ? "REGRESSED" : "ok");
+    }
+    free(doc);
+    return bad;
+}
+
+// one line per -i interval
+void interval_print(const struct rxcount *c, uint64_t sent, const struct hist *rtt,
+                    double from, double to)
+{
+    printf("[%.1f-%.1f s] sent %llu, received %llu, lost %llu, late %llu, dup %llu, "
+           "reordered %llu (max distance %llu)",
+           from, to, (unsigned long long)sent, (unsigned long long)c->received,
+           (unsigned long long)c->lost, (unsigned long long)c->late,
+           (unsigned long long)c->dups, (unsigned long long)c->reordered,
+           (unsigned long long)c->reorder_max);
+    if (rtt->total > 0)
+        printf(", RTT p50 %.3f ms, p99 %.3f ms, max %.3f ms",
+               hist_pct(rtt, 0.5) / 1e6, hist_pct(rtt, 0.99) / 1e6, rtt->max / 1e6);
+    printf("\n");
+    fflush(stdout);
 }
 
 int main(int argc, char *argv[])
 {
-    int sockfd;
+    int sockfd, fl;
     struct addrinfo hints, *servinfo, *p;
     int rv;
     int numbytes;
-    char send_buf[MAXBUFLEN];
     char recv_buf[MAXBUFLEN];
-    char num_str[20];
-    pid_t child_pid;
-    
-    int received[MAX_NUMS + 1];
-    long long send_times[MAX_NUMS + 1];
-    int total_received = 0;
-    long long min_rtt = 999999; 
+    char ctrl[TSTAMP_CTRLLEN];
+    struct iovec iov = { recv_buf, sizeof recv_buf };
+    struct msghdr msg;
+    pthread_t sender;
+    struct loadgen g;
+    int rcvbuf = 4 << 20;
+    struct sigaction sa;
+
+    static struct seqwin win;
+    struct rxcount cnt = {0}, ivl;
+    uint64_t last_sent = 0;
+    long long min_rtt = 0;
     long long max_rtt = 0;
     long long total_rtt = 0;
-    int valid_rtt_count = 0;
+    long valid_rtt_count = 0;
+    int interval = 0;   // -i, for the text lines
+    int period;         // reporting period: -i, or 1 s if only -J/-C want intervals
+    int opt;
+    // raw t2-t1 and t4-t3 include the clock offset between the hosts; the
+    // offset from the least-delayed exchange is taken out at the end
+    struct delay_stats fwd = {0}, rev = {0}, dwell = {0};
+    long long best_delay = -1, best_offset = 0;
+    int unstamped = 0;
+    // rtt is measured from the actual send. co is measured from the
+    // datagram's slot in the schedule, so a stall on our side shows up
+    // in the tail instead of quietly delaying the sends that would have
+    // seen it (coordinated omission). the ivl_ ones collect the current
+    // interval and are folded into the totals when it ends.
+    static struct hist rtt, co, ivl_rtt, ivl_co;
+    const char *save = NULL, *merge[MAXMERGE];
+    int nmerge = 0;
+    int kernel = 0;
+    uint64_t crc_ok = 0;
+    struct kslot *kring = NULL;
+    static struct kstats kst;
+    int nflows = 1, weight[MAXFLOWS], nweights = 0;
+    char *w;
+    const char *json_path = NULL, *csv_path = NULL, *baseline = NULL;
+    FILE *json = NULL, *csv = NULL;
+    double lat_pct = 10, tput_pct = 5;
+    int nrows = 0, ret = 0;
+    struct row row;
+    char label[24];
+    int sweep_min = 0, sweep_max = 0;
+    int windows[MAXSTEPS], nwindows = 0;
+    char send_buf[MAXBUFLEN];
+    double sweep_factor = 2;
+    const char *trace_path = NULL;
+    static struct trace_writer tw;
+    static struct trace_reader tr;
+    const struct cc_ops *xfer = NULL;
+    double tx_loss = 0, rx_loss = -1;
 
-    if (argc != 2) {
-        fprintf(stderr,"usage: client11c hostname\n");
-        exit(1);
+    memset(&g, 0, sizeof g);
+    g.count = 10000;
+    g.rate = 1000;
+    g.hdr_len = PROTO_HDRLEN;
+    g.batch = 1;
+    g.speed = 1;
+    g.flush_ns = (uint64_t)FLUSH_US * 1000;
+
+    while ((opt = getopt(argc, argv, "TKcr:n:s:i:H:A:f:w:J:C:B:X:l:z:W:b:t:p:x:m:k:y:L:")) != -1) {
+        switch (opt) {
+        case 'T':
+            g.reflect = 1;
+            g.hdr_len = REFLECT_HDRLEN;
+            break;
+        case 'K':
+            kernel = 1;
+            break;
+        case 'c':
+            g.trailer = CRC_TRAILER;
+            break;
+        case 'r':
+            g.rate = atof(optarg);
+            if (g.rate < 0)
+                usage();
+            break;
+        case 'n':
+            if (optarg[0] == '-')
+                usage();
+            g.count = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            g.spin_ns = atol(optarg) * 1000;
+            if (g.spin_ns < 0)
+                usage();
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            if (interval < 1)
+                usage();
+            break;
+        case 'H':
+            save = optarg;
+            break;
+        case 'A':
+            if (nmerge == MAXMERGE)
+                usage();
+            merge[nmerge++] = optarg;
+            break;
+        case 'f':
+            nflows = atoi(optarg);
+            if (nflows < 1 || nflows > MAXFLOWS)
+                usage();
+            break;
+        case 'w':
+            for (w = strtok(optarg, ","); w != NULL; w = strtok(NULL, ",")) {
+                if (nweights == MAXFLOWS || (weight[nweights++] = atoi(w)) < 1)
+                    usage();
+            }
+            break;
+        case 'l':
+            g.size = atoi(optarg);
+            if (g.size < 1 || g.size > MAXBUFLEN)
+                usage();
+            break;
+        case 'b':
+            if (strcmp(optarg, "auto") == 0) {
+                g.batch = 0;
+            } else {
+                g.batch = atoi(optarg);
+                if (g.batch < 1 || g.batch > MAXSEND)
+                    usage();
+            }
+            break;
+        case 'W':
+            for (w = strtok(optarg, ","); w != NULL; w = strtok(NULL, ",")) {
+                if (nwindows == MAXSTEPS || (windows[nwindows++] = atoi(w)) < 1)
+                    usage();
+            }
+            break;
+        case 'z':
+            if (sscanf(optarg, "%d:%d:%lf", &sweep_min, &sweep_max, &sweep_factor) < 2 ||
+                sweep_min < 1 || sweep_max < sweep_min || sweep_max > MAXBUFLEN ||
+                sweep_factor <= 1)
+                usage();
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'p':
+            if (trace_open(&tr, optarg) == -1) {
+                fprintf(stderr, "client: %s: not a readable trace\n", optarg);
+                return 1;
+            }
+            g.replay = &tr;
+            break;
+        case 'x':
+            g.speed = atof(optarg);
+            if (g.speed <= 0)
+                usage();
+            break;
+        case 'm': {
+            double flush_us = FLUSH_US;
+            if (sscanf(optarg, "%d:%lf", &g.mtu, &flush_us) < 1 || g.mtu < 1 ||
+                g.mtu > MAXBUFLEN || flush_us < 0)
+                usage();
+            g.flush_ns = flush_us * 1000;
+            break;
+        }
+        case 'k':
+            g.compact = atoi(optarg);
+            if (g.compact < 1)
+                usage();
+            break;
+        case 'y':
+            if ((xfer = cc_find(optarg)) == NULL)
+                usage();
+            g.reliable = 1;
+            g.hdr_len = DATA_HDRLEN;
+            break;
+        case 'L':
+            if (sscanf(optarg, "%lf:%lf", &tx_loss, &rx_loss) < 1 || tx_loss < 0 ||
+                tx_loss > 100 || rx_loss > 100)
+                usage();
+            break;
+        case 'J':
+            json_path = optarg;
+            break;
+        case 'C':
+            csv_path = optarg;
+            break;
+        case 'B':
+            baseline = optarg;
+            break;
+        case 'X':
+            if (sscanf(optarg, "%lf:%lf", &lat_pct, &tput_pct) < 1 || lat_pct < 0 || tput_pct < 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
     }
 
+    if (argc - optind != 1)
+        usage();
+    if (nweights > 0 && nflows > 1 && nweights != nflows)
+        usage();
+    if (sweep_max > 0 && (g.size > 0 || g.count == 0 || nwindows > 0))
+        usage();
+    if (nwindows > 1 && g.count == 0)
+        usage();
+    if (g.replay != NULL && (sweep_max > 0 || nwindows > 0 || kernel || g.size > 0))
+        usage();
+    if (g.replay != NULL) {
+        g.count = 0;
+        g.batch = 1;
+    }
+    // a bundle is its own batch, and the kernel stamps datagrams, not
+    // messages
+    if (g.mtu > 0 && (g.batch != 1 || nwindows > 0 || kernel))
+        usage();
+    // the reflector's stamps sit behind the full header. sizes are checked
+    // against the longest compact header, and datagrams are kept short
+    // enough for it to be told from a full one.
+    if (g.compact && g.reflect)
+        usage();
+    // a transfer is one flow of -n messages, sent as fast as its window
+    // lets it and checked off by acks rather than counted like echoes
+    if (xfer != NULL && (g.reflect || g.compact || g.mtu > 0 || g.batch != 1 || sweep_max > 0 ||
+                         nwindows > 0 || g.replay != NULL || trace_path != NULL || kernel ||
+                         nflows > 1 || nweights > 0 || interval > 0 || json_path != NULL ||
+                         csv_path != NULL || baseline != NULL || save != NULL || nmerge > 0))
+        usage();
+    if (xfer == NULL && (tx_loss > 0 || rx_loss >= 0))
+        usage();
+    if (rx_loss < 0)
+        rx_loss = tx_loss;
+    if (xfer != NULL && g.size > 0 && g.size < ACK_LEN + g.trailer) {
+        fprintf(stderr, "client: -y messages need at least %d bytes, for the ack\n",
+                ACK_LEN + g.trailer);
+        usage();
+    }
+    if (g.compact) {
+        g.hdr_len = PROTO_COMPACT_MAX;
+        if (g.size >= PROTO_COMPACT_LIMIT || sweep_max >= PROTO_COMPACT_LIMIT ||
+            g.mtu >= PROTO_COMPACT_LIMIT) {
+            fprintf(stderr, "client: -k datagrams have to be under %d bytes\n", PROTO_COMPACT_LIMIT);
+            usage();
+        }
+    }
+    if ((g.size > 0 && g.size < g.hdr_len + g.trailer) ||
+        (sweep_max > 0 && sweep_min < g.hdr_len + g.trailer)) {
+        fprintf(stderr, "client: datagrams need at least the %d byte header\n",
+                g.hdr_len + g.trailer);
+        usage();
+    }
+    if (sweep_max > 0) {
+        g.steps = calloc(MAXSTEPS, sizeof *g.steps);
+        if (g.steps == NULL) {
+            perror("client: malloc");
+            return 1;
+        }
+        for (double sz = sweep_min; g.nsteps < MAXSTEPS; sz = sz * sweep_factor) {
+            // sizes round down, but always move on, and the last is max
+            int next = sz < sweep_max ? (int)sz : sweep_max;
+            if (g.nsteps > 0 && next <= g.steps[g.nsteps - 1].size)
+                next = g.steps[g.nsteps - 1].size + 1;
+            g.steps[g.nsteps++].size = next;
+            if (next >= sweep_max)
+                break;
+            if (sz < next)
+                sz = next;
+        }
+        if (g.steps[g.nsteps - 1].size != sweep_max)
+            usage();
+    }
+    // enough per batch that batches are BATCH_US apart; as fast as
+    // possible just sends the largest
+    if (g.batch == 0 && g.rate > 0)
+        g.batch = g.rate * BATCH_US / 1e6 + 0.5;
+    if (g.batch == 0 && g.rate == 0)
+        g.batch = MAXSEND;
+    if (g.batch > MAXSEND)
+        g.batch = MAXSEND;
+    if (g.batch < 1)
+        g.batch = 1;
+    if (g.mtu > 0 && g.replay == NULL && max_len(&g) > g.mtu) {
+        fprintf(stderr, "client: -m %d is shorter than a %d byte message\n", g.mtu, max_len(&g));
+        usage();
+    }
+    if (g.mtu > 0 && g.mtu < g.hdr_len + g.trailer) {
+        fprintf(stderr, "client: -m %d is shorter than the %d byte header\n", g.mtu,
+                g.hdr_len + g.trailer);
+        usage();
+    }
+    if (nwindows == 1)
+        g.window = windows[0];
+    if (nwindows > 1) {
+        g.steps = calloc(nwindows, sizeof *g.steps);
+        if (g.steps == NULL) {
+            perror("client: malloc");
+            return 1;
+        }
+        for (int i = 0; i < nwindows; i++) {
+            g.steps[i].window = windows[i];
+            g.steps[i].size = g.size;
+        }
+        g.nsteps = nwindows;
+        g.window = windows[0];
+    }
+    if (nweights > 0)
+        nflows = nweights;
+    for (; nweights < nflows; nweights++)
+        weight[nweights] = 1;
+    if (sched_build(&g.sched, weight, nflows) == -1)
+        usage();
+    g.nflows = nflows;
+    g.flows = calloc(nflows, sizeof *g.flows);
+    if (g.flows == NULL) {
+        perror("client: malloc");
+        return 1;
+    }
+    for (int i = 0; i < nflows && g.mtu > 0; i++) {
+        struct bundle *b = &g.flows[i].bundle;
+        b->buf = malloc(MAXBUFLEN);
+        // as many as the shortest message fits: with -k hdr_len is the
+        // longest compact header, and most are much shorter
+        int min_msg = (g.compact ? PROTO_COMPACT_MIN : g.hdr_len) + g.trailer;
+        b->msgs = calloc(g.mtu / min_msg + 1, sizeof *b->msgs);
+        if (b->buf == NULL || b->msgs == NULL) {
+            perror("client: malloc");
+            return 1;
+        }
+    }
+
+    period = interval > 0 ? interval : json_path != NULL || csv_path != NULL ? 1 : 0;
+    if (json_path != NULL && (json = fopen(json_path, "w")) == NULL) {
+        perror(json_path);
+        return 1;
+    }
+    if (csv_path != NULL && (csv = fopen(csv_path, "w")) == NULL) {
+        perror(csv_path);
+        return 1;
+    }
+    if (json != NULL)
+        fprintf(json, "{\"client\": \"client11c\", \"host\": \"%s\", \"rate\": %.0f, "
+                "\"count\": %llu, \"flows\": %d, \"intervals\": [", argv[optind], g.rate,
+                (unsigned long long)g.count, nflows);
+    if (csv != NULL)
+        fputs(CSV_HEADER, csv);
+
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_DGRAM;
 
-    if ((rv = getaddrinfo(argv[1], SERVERPORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(argv[optind], SERVERPORT, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return 1;
     }
@@ -61,6 +2062,13 @@ int main(int argc, char *argv[])
             perror("client: socket");
             continue;
         }
+        // connected, so the sender skips the route lookup per datagram and
+        // the receiver only sees the server's replies
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            perror("client: connect");
+            continue;
+        }
         break;
     }
 
@@ -69,110 +2077,501 @@ int main(int argc, char *argv[])
         return 2;
     }
 
-    memset(received, 0, sizeof(received));
-    memset(send_times, 0, sizeof(send_times));
-
-    child_pid = fork();
-    
-    if (child_pid == 0) {
-        printf("Sender: starting to send numbers 1 to %d\n", MAX_NUMS);
-        
-        for (int i = 1; i <= MAX_NUMS; i++) {
-            sprintf(num_str, "%d", i);
-            int string_len = strlen(num_str);
-            int total_len = 2 + 4 + 8 + string_len;
-            
-            unsigned short net_msg_len = htons(total_len);
-            unsigned int net_seq_num = htonl(i);
-            long long net_timestamp = get_time_ms();
-            
-            memcpy(send_buf, &net_msg_len, 2);
-            memcpy(send_buf + 2, &net_seq_num, 4);
-            memcpy(send_buf + 6, &net_timestamp, 8);
-            memcpy(send_buf + 14, num_str, string_len);
-
-            send_times[i] = net_timestamp;
-
-            if (sendto(sockfd, send_buf, total_len, 0,
-                     p->ai_addr, p->ai_addrlen) == -1) {
-                perror("sendto");
-            }
-            
-            usleep(1000);  
-        }
-        
-        printf("Sender: finished sending all numbers\n");
-        exit(0);
-        
-    } else {
-        printf("Receiver: waiting for echoes\n");
-        
-        struct timeval tv;
-        tv.tv_sec = 3; 
-        tv.tv_usec = 0;
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        
-        int timeouts = 0;
-        
-        while (total_received < MAX_NUMS && timeouts < 5) {
-            numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN, 0, NULL, NULL);
-            
-            if (numbytes == -1) {
-                timeouts++;
-                printf("timeout #%d\n", timeouts);
+    // the other flows go to the same place; each connect picks its own
+    // ephemeral source port
+    for (int i = 0; i < nflows; i++) {
+        struct sockaddr_in local;
+        socklen_t len = sizeof local;
+
+        if (i > 0 && ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1 ||
+                      connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)) {
+            perror("client: socket");
+            return 2;
+        }
+        // room for the echoes that pile up while the receiver is descheduled
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+        if (kernel && tstamp_enable(sockfd) == -1) {
+            perror("client: setsockopt SO_TIMESTAMPING");
+            return 1;
+        }
+        if (getsockname(sockfd, (struct sockaddr *)&local, &len) == 0)
+            g.flows[i].port = ntohs(local.sin_port);
+        g.flows[i].fd = sockfd;
+    }
+
+    // every flow goes to the same server, so one answer does for all
+    if (g.compact && negotiate(g.flows[0].fd) != PROTO_COMPACT_V1) {
+        fprintf(stderr, "client: the server doesn't take the compact header, sending full ones\n");
+        g.compact = 0;
+        g.hdr_len = PROTO_HDRLEN;
+    } else if (g.compact) {
+        printf("Sender: compact header, a sync every %d messages per flow\n", g.compact);
+    }
+
+    // ctrl-c stops the sender; the receiver still drains and reports
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (xfer != NULL)
+        return transfer_run(&g, xfer, tx_loss, rx_loss);
+
+    g.ring = calloc(WINDOW, sizeof *g.ring);
+    if (g.ring == NULL) {
+        perror("client: malloc");
+        return 1;
+    }
+    if (g.replay != NULL && (g.sched.replay = calloc(WINDOW, sizeof *g.sched.replay)) == NULL) {
+        perror("client: malloc");
+        return 1;
+    }
+    if (trace_path != NULL) {
+        if (trace_create(&tw, trace_path, now_ns(), wall_ns()) == -1) {
+            perror(trace_path);
+            return 1;
+        }
+        g.tx_trace = malloc(sizeof *g.tx_trace);
+        g.rx_trace = malloc(sizeof *g.rx_trace);
+        if (g.tx_trace == NULL || g.rx_trace == NULL) {
+            perror("client: malloc");
+            return 1;
+        }
+        g.tx_trace->len = g.rx_trace->len = 0;
+        g.trace = &tw;
+    }
+    win.base = 1;
+    if (kernel && (kring = calloc(WINDOW, sizeof *kring)) == NULL) {
+        perror("client: malloc");
+        return 1;
+    }
+
+    // closed loop sends from this thread, as the replies come in
+    if (g.window > 0) {
+        memset(send_buf, 0, sizeof send_buf);
+        printf("Sender: closed loop, %d outstanding\n", g.window);
+        g.start_ns = now_ns();
+    } else if ((rv = pthread_create(&sender, NULL, sender_main, &g)) != 0) {
+        fprintf(stderr, "client: pthread_create: %s\n", strerror(rv));
+        return 1;
+    }
+
+    printf("Receiver: waiting for echoes\n");
+
+    // short timeout so we notice the sender finishing and can settle
+    // losses while nothing is arriving
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    setsockopt(g.flows[0].fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    uint64_t next_report = 0, report_from = 0;
+    unsigned since_settle = 0;
+
+    while (1) {
+        if (g.window > 0)
+            pump(&g, &win, send_buf);
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof ctrl;
+        numbytes = recv_any(&g, &msg, &fl);
+        uint64_t recv_ns = now_ns();
+
+        // the TX stamps don't wake a blocked recv, so pick them up here
+        if (kernel)
+            kstamp_drain(&g, kring, &kst, fl);
+
+        if (numbytes == -1 || ++since_settle == 256) {
+            since_settle = 0;
+            settle_expired(&g, &win, recv_ns);
+            if (__atomic_load_n(&g.done, __ATOMIC_ACQUIRE)) {
+                uint64_t hi = __atomic_load_n(&g.seq_hi, __ATOMIC_ACQUIRE);
+                // every seq_num answered: no need to wait out the timeout
+                if (win.seen == hi + 1 - win.base)
+                    seqwin_settle(&win, &g, hi + 1);
+                if (win.base > hi)
+                    break;
+            }
+        }
+
+        if (period > 0 && next_report == 0 &&
+            (report_from = __atomic_load_n(&g.start_ns, __ATOMIC_ACQUIRE)) != 0)
+            next_report = report_from + (uint64_t)period * 1000000000;
+        if (next_report != 0 && recv_ns >= next_report) {
+            uint64_t sent = __atomic_load_n(&g.sent, __ATOMIC_RELAXED);
+
+            settle_expired(&g, &win, recv_ns);
+            memset(&ivl, 0, sizeof ivl);
+            for (int i = 0; i < nflows; i++)
+                rxcount_add(&ivl, &g.flows[i].ivl);
+            row_fill(&row, &ivl, sent - last_sent, &ivl_rtt,
+                     (report_from - g.start_ns) / 1e9, (recv_ns - g.start_ns) / 1e9);
+            if (interval > 0)
+                interval_print(&ivl, sent - last_sent, &ivl_rtt, row.from, row.to);
+            if (json != NULL) {
+                fputs(nrows > 0 ? ",\n  " : "\n  ", json);
+                row_json(json, &row);
+            }
+            if (csv != NULL) {
+                snprintf(label, sizeof label, "%d", nrows);
+                row_csv(csv, label, &row);
+            }
+            nrows++;
+            for (int i = 0; i < nflows; i++) {
+                rxcount_add(&g.flows[i].cnt, &g.flows[i].ivl);
+                memset(&g.flows[i].ivl, 0, sizeof g.flows[i].ivl);
+            }
+            hist_merge(&rtt, &ivl_rtt);
+            hist_merge(&co, &ivl_co);
+            memset(&ivl_rtt, 0, sizeof ivl_rtt);
+            memset(&ivl_co, 0, sizeof ivl_co);
+            last_sent = sent;
+            report_from = recv_ns;
+            next_report += (uint64_t)period * 1000000000;
+        }
+
+        if (numbytes == -1)
+            continue;
+        if (g.trace != NULL)
+            trace_put(g.trace, g.rx_trace, recv_ns, numbytes, fl, TRACE_RECV);
+
+        // with -m a datagram carries several messages; otherwise it is
+        // one, whatever its length field says
+        for (int off = 0, mlen; off < numbytes; off += mlen) {
+            char *m = recv_buf + off;
+
+            mlen = g.mtu > 0 ? (int)proto_next(m, numbytes - off) : numbytes - off;
+            if (!g.compact && mlen < g.hdr_len) {
+                g.flows[fl].ivl.stray++;
+                continue;
+            }
+            // a corrupt message's seq_num can't be trusted either, so it is
+            // charged to the flow it came in on and its seq_num settles as
+            // lost. no trailer at all is corruption too, unless the echo was
+            // cut short.
+            if (g.trailer) {
+                int crc = proto_crc_check(m, mlen);
+
+                if (crc == CRC_BAD || (crc == CRC_NONE && mlen == (int)proto_msg_length(m, mlen))) {
+                    g.flows[fl].ivl.corrupt++;
+                    continue;
+                }
+                crc_ok += crc == CRC_OK;
+            }
+
+            // a compact message from an epoch whose sync never came back
+            // can't be placed, so it too is charged to its flow and its
+            // seq_num settles as lost
+            uint32_t wire;
+            uint64_t ts_us;
+
+            if (!g.compact) {
+                wire = proto_seq(m);
+            } else if ((rv = proto_compact_get(&g.flows[fl].rx_sync, m, mlen, &wire, &ts_us)) <= 0) {
+                if (rv == -1)
+                    g.flows[fl].ivl.unsynced++;
+                else
+                    g.flows[fl].ivl.stray++;
+                continue;
+            }
+
+            uint64_t seq = seq_widen(wire, win.max > win.base ? win.max : win.base);
+            uint64_t sent_ns, due_ns;
+
+            if (seq == 0 || seq > __atomic_load_n(&g.seq_hi, __ATOMIC_ACQUIRE)) {
+                g.flows[fl].ivl.stray++;
                 continue;
             }
-            
-            timeouts = 0;  
-            long long recv_time = get_time_ms();
-            
-            // extract number and original timestamp from the message
-            int num = atoi(recv_buf + 14);
-            long long orig_timestamp;
-            memcpy(&orig_timestamp, recv_buf + 6, 8);
-            
-            if (num >= 1 && num <= MAX_NUMS && received[num] == 0) {
-                received[num] = 1;
-                total_received++;
-                
-                long long rtt = recv_time - orig_timestamp;
-                
-                if (total_received <= 3) {
-                    printf("Debug packet %d: recv_time=%lld, orig_timestamp=%lld, rtt=%lld\n", 
-                           num, recv_time, orig_timestamp, rtt);
+            if (size_of(&g, seq) > 0 && mlen < size_of(&g, seq)) {
+                struct rxcount d = { .truncated = 1 };
+                rx_count(&g, seq, &d);
+            }
+            if (seqwin_add(&win, &g, seq) == 0)
+                continue;
+            // a late reply still has an RTT as long as its ring slot does
+            if (!ring_get(&g, seq, &sent_ns, &due_ns))
+                continue;
+
+            // RTT from the sender's monotonic clock, not the wire timestamp,
+            // so it is in ns and immune to wall clock steps
+            long long rtt_ns = recv_ns - sent_ns;
+            if (valid_rtt_count == 0 || rtt_ns < min_rtt) min_rtt = rtt_ns;
+            if (rtt_ns > max_rtt) max_rtt = rtt_ns;
+            total_rtt += rtt_ns;
+            valid_rtt_count++;
+            hist_add(&ivl_rtt, rtt_ns, 1);
+            hist_add(&ivl_co, recv_ns - due_ns, 1);
+            if (nflows > 1)
+                hist_add(&g.flows[fl].rtt, rtt_ns, 1);
+            if (g.nsteps > 0)
+                hist_add(&g.steps[step_of(&g, seq)].rtt, rtt_ns, 1);
+
+            if (kernel) {
+                struct kslot *k = kslot_get(kring, seq);
+
+                if (!k->rx.sw && tstamp_parse(&msg, &k->rx)) {
+                    k->user_ns = rtt_ns;
+                    kst.rx_stamps++;
+                    kslot_check(k, &kst);
                 }
-                
-                // RTT should be less than 1 second for local
-                if (rtt > 0 && rtt < 1000) {
-                    if (valid_rtt_count == 0 || rtt < min_rtt) min_rtt = rtt;
-                    if (rtt > max_rtt) max_rtt = rtt;
-                    total_rtt += rtt;
-                    valid_rtt_count++;
+            }
+
+            if (g.reflect) {
+                if (mlen < REFLECT_HDRLEN || proto_reflect_rx(m) == 0) {
+                    unstamped++;
+                } else {
+                    long long t1 = proto_timestamp(m) * 1000, t4 = wall_ns();
+                    long long t2 = proto_reflect_rx(m), t3 = proto_reflect_tx(m);
+                    long long delay = (t4 - t1) - (t3 - t2);
+
+                    delay_add(&fwd, t2 - t1);
+                    delay_add(&rev, t4 - t3);
+                    delay_add(&dwell, t3 - t2);
+                    if (best_delay < 0 || delay < best_delay) {
+                        best_delay = delay;
+                        best_offset = ((t2 - t1) + (t3 - t4)) / 2;
+                    }
                 }
             }
+        }
+    }
+
+    if (g.window == 0)
+        pthread_join(sender, NULL);
+    if (g.trace != NULL) {
+        trace_flush(g.trace, g.tx_trace);
+        trace_flush(g.trace, g.rx_trace);
+        if (trace_finish(g.trace) != 0)
+            perror(trace_path);
+    }
+
+    // the last, partial interval
+    memset(&ivl, 0, sizeof ivl);
+    for (int i = 0; i < nflows; i++) {
+        rxcount_add(&ivl, &g.flows[i].ivl);
+        rxcount_add(&g.flows[i].cnt, &g.flows[i].ivl);
+        rxcount_add(&cnt, &g.flows[i].cnt);
+    }
+    if (period > 0 && ivl.received + ivl.lost + ivl.late > 0) {
+        row_fill(&row, &ivl, g.sent - last_sent, &ivl_rtt,
+                 (report_from - g.start_ns) / 1e9, (now_ns() - g.start_ns) / 1e9);
+        if (interval > 0)
+            interval_print(&ivl, g.sent - last_sent, &ivl_rtt, row.from, row.to);
+        if (json != NULL) {
+            fputs(nrows > 0 ? ",\n  " : "\n  ", json);
+            row_json(json, &row);
+        }
+        if (csv != NULL) {
+            snprintf(label, sizeof label, "%d", nrows);
+            row_csv(csv, label, &row);
+        }
+    }
+    hist_merge(&rtt, &ivl_rtt);
+    hist_merge(&co, &ivl_co);
+
+    double secs = (g.end_ns - g.start_ns) / 1e9;
+
+    // rates over the send period, like the offered rate below
+    row_fill(&row, &cnt, g.sent, &rtt, 0, secs);
+    if (json != NULL) {
+        fputs("\n], \"summary\": ", json);
+        row_json(json, &row);
+        fputs("}\n", json);
+        fclose(json);
+    }
+    if (csv != NULL) {
+        row_csv(csv, "total", &row);
+        fclose(csv);
+    }
+
+    printf("\n--- STATISTICS ---\n");
+    printf("Total sent: %llu (%llu send errors)\n", (unsigned long long)g.sent,
+           (unsigned long long)g.send_errors);
+    printf("Total received: %llu\n", (unsigned long long)cnt.received);
+    printf("Missing: %llu\n", (unsigned long long)cnt.lost);
+    printf("Late (more than %d ms, not counted as received): %llu\n", DRAIN_MS,
+           (unsigned long long)cnt.late);
+    printf("Duplicates: %llu\n", (unsigned long long)cnt.dups);
+    printf("Reordered: %llu (avg distance %.1f, max %llu)\n", (unsigned long long)cnt.reordered,
+           cnt.reordered ? (double)cnt.reorder_sum / cnt.reordered : 0.0,
+           (unsigned long long)cnt.reorder_max);
+    if (cnt.stray > 0)
+        printf("Stray replies: %llu\n", (unsigned long long)cnt.stray);
+    if (g.compact)
+        printf("Compact header: %.1f bytes per message (full: %d), %llu syncs, "
+               "%llu replies undecodable (counted as lost)\n",
+               g.sent + g.send_errors ? (double)g.hdr_bytes / (g.sent + g.send_errors) : 0.0,
+               PROTO_HDRLEN, (unsigned long long)g.syncs, (unsigned long long)cnt.unsynced);
+    if (cnt.truncated > 0)
+        printf("Short echoes (cut down by the server?): %llu\n", (unsigned long long)cnt.truncated);
+    if (g.trailer)
+        printf("CRC32C (%s): %llu ok, %llu corrupted (counted as lost)\n", crc32c_impl,
+               (unsigned long long)crc_ok, (unsigned long long)cnt.corrupt);
+    if (nwindows > 1)
+        printf("Closed loop: %d windows, achieved %.0f pps over %.3f s\n",
+               nwindows, secs > 0 ? g.sent / secs : 0.0, secs);
+    else if (g.window > 0)
+        printf("Closed loop: %d outstanding, achieved %.0f pps over %.3f s\n",
+               g.window, secs > 0 ? g.sent / secs : 0.0, secs);
+    else if (g.replay != NULL)
+        printf("Replay: %gx the recorded pace, achieved %.0f pps over %.3f s\n",
+               g.speed, secs > 0 ? (g.sent + g.send_errors) / secs : 0.0, secs);
+    else if (g.rate == 0)
+        printf("Offered rate: as fast as possible, achieved %.0f pps over %.3f s\n",
+               secs > 0 ? (g.sent + g.send_errors) / secs : 0.0, secs);
+    else
+        printf("Offered rate: target %.0f pps, achieved %.0f pps over %.3f s\n",
+               g.rate, secs > 0 ? (g.sent + g.send_errors) / secs : 0.0, secs);
+    if (g.window == 0)
+        printf("Send schedule: avg lag %.1f us, max lag %.1f us, %llu sends more than %d us late\n",
+               g.sent ? g.total_lag_ns / 1e3 / g.sent : 0.0, g.max_lag_ns / 1e3,
+               (unsigned long long)g.late, LATE_NS / 1000);
+    if (g.mtu > 0)
+        printf("Coalesced: %llu messages in %llu datagrams (%.1f per datagram)\n",
+               (unsigned long long)g.sent, (unsigned long long)g.datagrams,
+               g.datagrams ? (double)g.sent / g.datagrams : 0.0);
+
+    if (valid_rtt_count > 0) {
+        printf("Valid RTT measurements: %ld\n", valid_rtt_count);
+        printf("Smallest RTT: %.3f ms\n", min_rtt / 1e6);
+        printf("Largest RTT: %.3f ms\n", max_rtt / 1e6);
+        printf("Average RTT: %.3f ms\n", (double)total_rtt / valid_rtt_count / 1e6);
+        hist_print("RTT", &rtt);
+        hist_print("RTT from intended send", &co);
+    } else {
+        printf("No valid RTT measurements collected\n");
+    }
+
+    if (g.nsteps > 0 && nwindows > 1)
+        printf("Window sweep (%llu datagrams per window):\n", (unsigned long long)g.count);
+    else if (g.nsteps > 0)
+        printf("Size sweep (%llu datagrams per size; goodput counts UDP payload):\n",
+               (unsigned long long)g.count);
+    if (g.nsteps > 0) {
+        for (int i = 0; i < g.nsteps; i++) {
+            struct step *st = &g.steps[i];
+            double t = (st->end_ns - st->start_ns) / 1e9;
+            uint64_t settled = st->c.received + st->c.lost;
+
+            if (nwindows > 1)
+                printf("  W %5d: %8.0f pps", st->window, t > 0 ? st->c.received / t : 0.0);
+            else
+                printf("  %5d B: %8.0f pps", st->size, t > 0 ? st->c.received / t : 0.0);
+            if (st->size > 0)
+                printf(", goodput %9.3f Mbit/s", t > 0 ? st->c.received * st->size * 8 / t / 1e6 : 0.0);
+            printf(", loss %6.2f%%", settled ? 100.0 * st->c.lost / settled : 0.0);
+            if (st->c.truncated > 0)
+                printf(" (%llu short)", (unsigned long long)st->c.truncated);
+            if (st->rtt.total > 0)
+                printf(", RTT p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms",
+                       hist_pct(&st->rtt, 0.5) / 1e6, hist_pct(&st->rtt, 0.99) / 1e6,
+                       hist_pct(&st->rtt, 0.999) / 1e6, st->rtt.max / 1e6);
+            printf("\n");
+        }
+    }
+
+    if (nflows > 1) {
+        printf("Flows (source port, weight):\n");
+        for (int i = 0; i < nflows; i++) {
+            struct flow *f = &g.flows[i];
+            printf("  %u (%d): sent %llu, received %llu, lost %llu, late %llu, dup %llu, "
+                   "reordered %llu", f->port, weight[i], (unsigned long long)f->sent,
+                   (unsigned long long)f->cnt.received, (unsigned long long)f->cnt.lost,
+                   (unsigned long long)f->cnt.late, (unsigned long long)f->cnt.dups,
+                   (unsigned long long)f->cnt.reordered);
+            if (f->rtt.total > 0)
+                printf(", RTT p50 %.3f ms, p99 %.3f ms, max %.3f ms", hist_pct(&f->rtt, 0.5) / 1e6,
+                       hist_pct(&f->rtt, 0.99) / 1e6, f->rtt.max / 1e6);
+            printf("\n");
+        }
+    }
 
+    if (kernel) {
+        printf("Kernel timestamps: %llu sends, %llu replies\n",
+               (unsigned long long)kst.tx_stamps, (unsigned long long)kst.rx_stamps);
+        if (kst.sw.total > 0) {
+            hist_print("RTT (user space)", &rtt);
+            hist_print("RTT (kernel)", &kst.sw);
+            hist_print("Host overhead (user space - kernel)", &kst.host);
         }
-        
-        wait(NULL); 
-        
-        printf("\n--- STATISTICS ---\n");
-        printf("Total sent: %d\n", MAX_NUMS);
-        printf("Total received: %d\n", total_received);
-        printf("Missing: %d\n", MAX_NUMS - total_received);
-        
-        if (valid_rtt_count > 0) {
-            printf("Valid RTT measurements: %d\n", valid_rtt_count);
-            printf("Smallest RTT: %.2f ms\n", (double)min_rtt / 1000.0);
-            printf("Largest RTT: %.2f ms\n", (double)max_rtt / 1000.0);
-            printf("Average RTT: %.2f ms\n", (double)total_rtt / valid_rtt_count / 1000.0);
+        if (kst.hw.total > 0)
+            hist_print("RTT (NIC hardware)", &kst.hw);
+        else
+            printf("No hardware timestamps (is hardware stamping enabled on the NIC?)\n");
+    }
+
+    if (g.reflect && dwell.count > 0) {
+        printf("Reflector timestamps: %d (%d replies unstamped)\n", dwell.count, unstamped);
+        printf("Clock offset estimate: %.3f ms\n", best_offset / 1e6);
+        delay_print("Forward delay", &fwd, -best_offset);
+        delay_print("Reverse delay", &rev, best_offset);
+        delay_print("Server dwell", &dwell, 0);
+    } else if (g.reflect) {
+        printf("No reflector timestamps (is the server running with -R?)\n");
+    }
+
+    if (save != NULL) {
+        FILE *f = fopen(save, "w");
+        if (f == NULL) {
+            perror(save);
         } else {
-            printf("No valid RTT measurements collected\n");
+            fprintf(f, "# client11c %s rate %.0f count %llu\n", argv[optind], g.rate,
+                    (unsigned long long)g.sent);
+            hist_write(f, "rtt_bucket", &rtt);
+            hist_write(f, "co_bucket", &co);
+            fclose(f);
+            printf("Histograms saved to %s\n", save);
+        }
+    }
+    if (trace_path != NULL)
+        printf("Trace saved to %s\n", trace_path);
+
+    if (nmerge > 0) {
+        static struct hist all_rtt, all_co;
+        hist_merge(&all_rtt, &rtt);
+        hist_merge(&all_co, &co);
+        for (int i = 0; i < nmerge; i++) {
+            FILE *f = fopen(merge[i], "r");
+            if (f == NULL) {
+                perror(merge[i]);
+                continue;
+            }
+            hist_read(f, "rtt_bucket", &all_rtt);
+            hist_read(f, "co_bucket", &all_co);
+            fclose(f);
         }
-        
-        printf("\n");
+        printf("Merged with %d saved run(s):\n", nmerge);
+        hist_print("RTT", &all_rtt);
+        hist_print("RTT from intended send", &all_co);
+    }
+
+    if (baseline != NULL) {
+        int bad = baseline_check(baseline, &row, lat_pct, tput_pct);
+        if (bad != 0)
+            ret = bad > 0 ? BASELINE_EXIT : 1;
+        if (bad > 0)
+            printf("%d metric(s) regressed against the baseline\n", bad);
     }
 
+    printf("\n");
+
+    free(g.ring);
+    free(g.sched.replay);
+    free(g.tx_trace);
+    free(g.rx_trace);
+    trace_close(&tr);
+    free(kring);
     freeaddrinfo(servinfo);
-    close(sockfd);
-    return 0;
-}
\ No newline at end of file
+    for (int i = 0; i < nflows; i++) {
+        close(g.flows[i].fd);
+        free(g.flows[i].bundle.buf);
+        free(g.flows[i].bundle.msgs);
+    }
+    free(g.flows);
+    free(g.steps);
+    return ret;
+}
@@ -0,0 +1,215 @@
+// CRC32C (Castagnoli), as used by iSCSI and ext4, for the protocol's
+// optional integrity trailer (proto.h).
+//
+// on x86 with SSE4.2 and on ARMv8 with the CRC extension this uses the
+// CPU's crc32c instructions, 8 bytes at a time on three streams at once;
+// elsewhere it falls back to slicing-by-8 tables. which one is picked once
+// at startup, from what the CPU running the binary has, so one build works
+// everywhere.
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#define crc32c_u8(c, b) _mm_crc32_u8(c, b)
+#define crc32c_u64(c, v) _mm_crc32_u64(c, v)
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_HW 1
+#define CRC32C_TARGET __attribute__((target("+crc")))
+#define crc32c_u8(c, b) __crc32cb(c, b)
+#define crc32c_u64(c, v) __crc32cd(c, v)
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // reflected
+#define CRC32C_LONG 256        // bytes per stream in the interleaved loops
+#define CRC32C_SHORT 32
+
+static uint32_t crc32c_table[8][256];
+// crc32c_long[k][b]: byte k of a crc being b, moved past CRC32C_LONG zero
+// bytes (the same for _short)
+static uint32_t crc32c_long[4][256], crc32c_short[4][256];
+
+// crc is the running, un-inverted value
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    // 8 bytes per step, one table per byte position
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// the crc of some data followed by n zero bytes, by table (see crc32c_zeros)
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t crc32c_gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void crc32c_gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = crc32c_gf2_times(mat, mat[n]);
+}
+
+// tables that move a crc past len zero bytes: the operator for one zero
+// bit, squared up to len bytes (as in zlib's crc32_combine)
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+    uint32_t even[32], odd[32], *op = odd;
+    uint32_t row = 1;
+
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    crc32c_gf2_square(even, odd);  // 2 zero bits
+    crc32c_gf2_square(odd, even);  // 4
+    for (;;) {
+        crc32c_gf2_square(even, odd);  // 8, then 32, ...
+        op = even;
+        if ((len >>= 1) == 0)
+            break;
+        crc32c_gf2_square(odd, even);
+        op = odd;
+        if ((len >>= 1) == 0)
+            break;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = crc32c_gf2_times(op, n);
+        zeros[1][n] = crc32c_gf2_times(op, n << 8);
+        zeros[2][n] = crc32c_gf2_times(op, n << 16);
+        zeros[3][n] = crc32c_gf2_times(op, n << 24);
+    }
+}
+
+#ifdef CRC32C_HW
+static inline uint64_t crc32c_load(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// the crc instruction takes 3 cycles but a new one can start every cycle,
+// so a single dependent chain runs at a third of the speed the unit can.
+// three streams over consecutive blocks keep it full; the first two are
+// then moved past the blocks after them and folded in.
+CRC32C_TARGET
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t c0 = crc, c1, c2;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c0 = crc32c_u8(c0, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC32C_LONG) {
+        c1 = c2 = 0;
+        for (const unsigned char *end = p + CRC32C_LONG; p < end; p += 8) {
+            c0 = crc32c_u64(c0, crc32c_load(p));
+            c1 = crc32c_u64(c1, crc32c_load(p + CRC32C_LONG));
+            c2 = crc32c_u64(c2, crc32c_load(p + 2 * CRC32C_LONG));
+        }
+        c0 = crc32c_shift(crc32c_long, c0) ^ c1;
+        c0 = crc32c_shift(crc32c_long, c0) ^ c2;
+        p += 2 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+    while (len >= 3 * CRC32C_SHORT) {
+        c1 = c2 = 0;
+        for (const unsigned char *end = p + CRC32C_SHORT; p < end; p += 8) {
+            c0 = crc32c_u64(c0, crc32c_load(p));
+            c1 = crc32c_u64(c1, crc32c_load(p + CRC32C_SHORT));
+            c2 = crc32c_u64(c2, crc32c_load(p + 2 * CRC32C_SHORT));
+        }
+        c0 = crc32c_shift(crc32c_short, c0) ^ c1;
+        c0 = crc32c_shift(crc32c_short, c0) ^ c2;
+        p += 2 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+        c0 = crc32c_u64(c0, crc32c_load(p));
+    while (len-- > 0)
+        c0 = crc32c_u8(c0, *p++);
+    return c0;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t) = crc32c_sw;
+static const char *crc32c_impl = "slicing-by-8";
+
+// runs before main, so the threads never race on it
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    for (unsigned i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (unsigned i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = crc32c_table[0][crc32c_table[t - 1][i] & 0xff] ^
+                                 (crc32c_table[t - 1][i] >> 8);
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+#if defined(CRC32C_HW) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn = crc32c_hw;
+        crc32c_impl = "sse4.2";
+    }
+#elif defined(CRC32C_HW)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_fn = crc32c_hw;
+        crc32c_impl = "armv8 crc";
+    }
+#endif
+}
+
+static inline uint32_t crc32c(const void *buf, size_t len)
+{
+    return ~crc32c_fn(~0U, buf, len);
+}
+
+#endif
@@ -0,0 +1,129 @@
+// log-linear latency histogram shared by server11 and client11c.
+//
+// values are ns. below 2^HIST_SUB every value has its own bucket; above
+// that each power of 2 is split into 2^HIST_SUB linear sub-buckets, so a
+// bucket is never wider than 1/128 (0.8%) of the values in it, from 1 ns
+// up to 2^40 ns (~18 min). counts are plain sums, so histograms from
+// several threads, workers or saved runs merge by adding them up.
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB 7      // log2 of the linear sub-buckets per power of 2
+#define HIST_MAXLOG 40  // values at or above 2^40 ns share the last bucket
+#define HIST_BUCKETS ((HIST_MAXLOG - HIST_SUB + 1) << HIST_SUB)
+
+// one writer at a time; readers on other threads go through hist_merge
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+// bucket for v: the top HIST_SUB bits after the leading one pick the
+// linear sub-bucket within its power of 2
+static inline unsigned hist_index(uint64_t v)
+{
+    int e;
+
+    if (v < (1u << HIST_SUB))
+        return v;
+    if (v >> HIST_MAXLOG)
+        return HIST_BUCKETS - 1;
+    e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB + 1) << HIST_SUB) + ((v >> (e - HIST_SUB)) & ((1u << HIST_SUB) - 1));
+}
+
+// smallest value that lands in bucket i
+static inline uint64_t hist_value(unsigned i)
+{
+    unsigned e = i >> HIST_SUB, sub = i & ((1u << HIST_SUB) - 1);
+
+    if (e == 0)
+        return i;
+    return (uint64_t)((1u << HIST_SUB) | sub) << (e - 1);
+}
+
+// relaxed stores so another thread can hist_merge a live histogram
+static inline void hist_add(struct hist *h, uint64_t v, uint64_t n)
+{
+    unsigned i = hist_index(v);
+
+    __atomic_store_n(&h->counts[i], h->counts[i] + n, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + n, __ATOMIC_RELAXED);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+// add src (possibly still being written) into dst. total is recounted
+// from the buckets so percentiles stay consistent with what was copied.
+static inline void hist_merge(struct hist *dst, const struct hist *src)
+{
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t c = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+        dst->counts[i] += c;
+        dst->total += c;
+    }
+    if (max > dst->max)
+        dst->max = max;
+}
+
+// value at quantile q (0-1), reported as the top of its bucket
+static inline uint64_t hist_pct(const struct hist *h, double q)
+{
+    uint64_t want = q * h->total, seen = 0;
+
+    if (h->total == 0)
+        return 0;
+    if (want == 0)
+        want = 1;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            uint64_t top = hist_value(i + 1) - 1;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+// save the non-empty buckets as "<name> <lowest ns> <count>" lines
+static inline void hist_write(FILE *f, const char *name, const struct hist *h)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (h->counts[i] > 0)
+            fprintf(f, "%s %llu %llu\n", name, (unsigned long long)hist_value(i),
+                    (unsigned long long)h->counts[i]);
+    }
+}
+
+// add every "<name> <ns> <count>" line in f into h and skip anything
+// else, so one file can hold several histograms. max comes back as the
+// top of the highest bucket. returns the number of samples read.
+static inline uint64_t hist_read(FILE *f, const char *name, struct hist *h)
+{
+    char line[256], tag[64];
+    unsigned long long v, n;
+    uint64_t added = 0;
+
+    rewind(f);
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "%63s %llu %llu", tag, &v, &n) != 3 || strcmp(tag, name) != 0)
+            continue;
+        unsigned i = hist_index(v);
+        h->counts[i] += n;
+        h->total += n;
+        added += n;
+        v = i + 1 < HIST_BUCKETS ? hist_value(i + 1) - 1 : v;
+        if (v > h->max)
+            h->max = v;
+    }
+    return added;
+}
+
+#endif
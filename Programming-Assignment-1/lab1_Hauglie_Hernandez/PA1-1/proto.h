@@ -0,0 +1,443 @@
+// the echo protocol's wire header, shared by server11, client11b and
+// client11c:
+//
+//     0   uint16 length      whole datagram, header included
+//     2   uint32 seq_num
+//     6   uint64 timestamp   client send time, us since the epoch
+//     14  payload
+//
+// and, for the reflector (client -T, server -R), right after it:
+//
+//     14  uint32 magic       REFLECT_MAGIC
+//     18  uint64 rx_ns       server receive time, ns since the epoch
+//     26  uint64 tx_ns       server transmit time
+//     34  payload
+//
+// and, for reliable transfers (client -y), right after it:
+//
+//     14  uint32 magic       DATA_MAGIC
+//     18  payload
+//
+// which the server answers with an ack in place of the echo:
+//
+//     0   header             the data's seq_num and timestamp
+//     14  uint32 magic       ACK_MAGIC
+//     18  uint32 max_seq     highest seq_num the server has seen on the flow
+//     22  uint64 window      bit i set: max_seq - i has been seen
+//     30
+//
+// so every ack says which copy of which seq_num it answers (by its
+// timestamp), and selectively acks the 64 newest seq_nums besides.
+//
+// and, for the integrity check (client -c), at the very end:
+//
+//     len-8  uint32 magic    CRC_MAGIC
+//     len-4  uint32 crc      CRC32C of everything before it
+//
+// a datagram can also carry several messages back to back (client -m),
+// each with its own header and length; proto_next splits them.
+//
+// a client can ask for a compact header instead (client -k), with a hello
+// message: the full header with seq_num 0, then
+//
+//     14  uint32 magic       PROTO_HELLO
+//     18  uint8  version     highest compact version the client speaks
+//     19  uint8  accepted    0, set by the server to the version it takes
+//
+// a server that doesn't know it echoes the 0 back, and the client keeps
+// the full header. once accepted, every message starts with
+//
+//     0   uint8  PROTO_COMPACT
+//     1   uint8  flags       PROTO_SYNC, and the epoch in the low 7 bits
+//     2   varint length
+//         varint seq_num
+//         varint timestamp   us
+//
+// the varints are LEB128. a sync message carries seq_num and timestamp
+// as they are and starts the flow's next epoch; the rest carry them minus
+// those of their epoch's sync message, which is usually 1-2 bytes for the
+// seq_num and 2-3 for the timestamp. a lost message then costs only
+// itself, and a lost sync the rest of its epoch, rather than everything
+// up to the next one. no full header under 65280 bytes starts with
+// PROTO_COMPACT, so compact messages are kept under that and the two
+// tell themselves apart.
+//
+// every field is big-endian. the accessors read and write the fields in
+// place in a send or receive buffer. a fixed-size memcpy compiles to one
+// (possibly unaligned, possibly byte-swapping) load or store, so there is
+// no copy of the header and no type-punned pointer into the buffer.
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/socket.h>
+
+#include "crc32c.h"
+
+#define PROTO_LEN_OFF 0
+#define PROTO_SEQ_OFF 2
+#define PROTO_TS_OFF 6
+#define PROTO_HDRLEN 14
+
+#define REFLECT_MAGIC 0x52464c54 // "RFLT"
+#define REFLECT_MAGIC_OFF 14
+#define REFLECT_RX_OFF 18
+#define REFLECT_TX_OFF 26
+#define REFLECT_HDRLEN 34
+
+#define DATA_MAGIC 0x52444154 // "RDAT"
+#define DATA_HDRLEN 18
+#define ACK_MAGIC 0x5241434b  // "RACK"
+#define ACK_MAX_OFF 18
+#define ACK_WINDOW_OFF 22
+#define ACK_LEN 30
+#define ACK_WINDOW 64         // seq_nums covered by the window
+
+#define PROTO_HELLO 0x434d5054 // "CMPT"
+#define PROTO_HELLO_LEN 20
+#define PROTO_COMPACT_V1 1
+
+#define PROTO_COMPACT 0xff
+#define PROTO_SYNC 0x80
+#define PROTO_EPOCHS 128
+#define PROTO_COMPACT_MIN 5     // tag, flags and three one-byte varints
+#define PROTO_COMPACT_MAX 20    // and with the longest varints
+#define PROTO_COMPACT_LIMIT 0xff00 // compact messages are shorter than this
+
+#define CRC_MAGIC 0x43524343 // "CRCC"
+#define CRC_TRAILER 8
+
+enum { CRC_NONE, CRC_OK, CRC_BAD };
+
+static inline uint16_t proto_get16(const void *buf, size_t off)
+{
+    uint16_t v;
+    memcpy(&v, (const char *)buf + off, sizeof v);
+    return be16toh(v);
+}
+
+static inline uint32_t proto_get32(const void *buf, size_t off)
+{
+    uint32_t v;
+    memcpy(&v, (const char *)buf + off, sizeof v);
+    return be32toh(v);
+}
+
+static inline uint64_t proto_get64(const void *buf, size_t off)
+{
+    uint64_t v;
+    memcpy(&v, (const char *)buf + off, sizeof v);
+    return be64toh(v);
+}
+
+static inline void proto_put16(void *buf, size_t off, uint16_t v)
+{
+    v = htobe16(v);
+    memcpy((char *)buf + off, &v, sizeof v);
+}
+
+static inline void proto_put32(void *buf, size_t off, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy((char *)buf + off, &v, sizeof v);
+}
+
+static inline void proto_put64(void *buf, size_t off, uint64_t v)
+{
+    v = htobe64(v);
+    memcpy((char *)buf + off, &v, sizeof v);
+}
+
+// callers check len >= PROTO_HDRLEN (or >= PROTO_TS_OFF for just the
+// seq_num) before using these on a received datagram
+static inline uint16_t proto_length(const void *buf) { return proto_get16(buf, PROTO_LEN_OFF); }
+static inline uint32_t proto_seq(const void *buf) { return proto_get32(buf, PROTO_SEQ_OFF); }
+static inline uint64_t proto_timestamp(const void *buf) { return proto_get64(buf, PROTO_TS_OFF); }
+
+static inline size_t proto_varint_len(uint64_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline size_t proto_put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// returns 0 on a truncated or overlong varint
+static inline size_t proto_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    size_t n = 0;
+
+    *v = 0;
+    while (p + n < end && n < 10) {
+        *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n++] & 0x80))
+            return n;
+    }
+    return 0;
+}
+
+static inline int proto_is_compact(const void *buf, size_t len)
+{
+    return len > 0 && len < PROTO_COMPACT_LIMIT && *(const uint8_t *)buf == PROTO_COMPACT;
+}
+
+// the length field of the message at the start of buf (len bytes left),
+// whichever header it has; 0 if there isn't a whole one
+static inline size_t proto_msg_length(const void *buf, size_t len)
+{
+    uint64_t n;
+
+    if (proto_is_compact(buf, len))
+        return len >= PROTO_COMPACT_MIN &&
+               proto_get_varint((const uint8_t *)buf + 2, (const uint8_t *)buf + len, &n) ? n : 0;
+    return len >= PROTO_HDRLEN ? proto_length(buf) : 0;
+}
+
+// length of the message at the start of buf, with len bytes left in the
+// datagram. a length that doesn't make sense (shorter than a header, or
+// running past the end, as when the server cut the datagram short) means
+// the message takes the rest, so a datagram with one message is one
+// message whatever its length field says.
+static inline size_t proto_next(const void *buf, size_t len)
+{
+    size_t n = proto_msg_length(buf, len);
+
+    if (n < (proto_is_compact(buf, len) ? PROTO_COMPACT_MIN : PROTO_HDRLEN) || n > len)
+        return len;
+    return n;
+}
+
+static inline void proto_set_header(void *buf, uint16_t len, uint32_t seq, uint64_t ts_us)
+{
+    proto_put16(buf, PROTO_LEN_OFF, len);
+    proto_put32(buf, PROTO_SEQ_OFF, seq);
+    proto_put64(buf, PROTO_TS_OFF, ts_us);
+}
+
+// stamp the header of each of msgs[0..n) in place: its length from its
+// first iovec, seq_num seq[i], and one send time for the whole batch,
+// since it all goes out in one sendmmsg. the iovecs must hold at least
+// PROTO_HDRLEN bytes.
+static inline void proto_stamp_batch(struct mmsghdr *msgs, unsigned n, const uint32_t *seq,
+                                     uint64_t ts_us)
+{
+    for (unsigned i = 0; i < n; i++) {
+        struct iovec *iov = msgs[i].msg_hdr.msg_iov;
+        proto_set_header(iov->iov_base, iov->iov_len, seq[i], ts_us);
+    }
+}
+
+// reflector fields: the magic with zeroed stamps for the server to fill
+static inline void proto_reflect_init(void *buf)
+{
+    proto_put32(buf, REFLECT_MAGIC_OFF, REFLECT_MAGIC);
+    memset((char *)buf + REFLECT_RX_OFF, 0, 16);
+}
+
+static inline int proto_is_reflect(const void *buf, size_t len)
+{
+    return len >= REFLECT_HDRLEN && !proto_is_compact(buf, len) &&
+           proto_get32(buf, REFLECT_MAGIC_OFF) == REFLECT_MAGIC;
+}
+
+static inline uint64_t proto_reflect_rx(const void *buf) { return proto_get64(buf, REFLECT_RX_OFF); }
+static inline uint64_t proto_reflect_tx(const void *buf) { return proto_get64(buf, REFLECT_TX_OFF); }
+
+static inline void proto_reflect_stamp(void *buf, uint64_t rx_ns, uint64_t tx_ns)
+{
+    proto_put64(buf, REFLECT_RX_OFF, rx_ns);
+    proto_put64(buf, REFLECT_TX_OFF, tx_ns);
+}
+
+static inline void proto_data_init(void *buf)
+{
+    proto_put32(buf, REFLECT_MAGIC_OFF, DATA_MAGIC);
+}
+
+static inline int proto_is_data(const void *buf, size_t len)
+{
+    return len >= DATA_HDRLEN && !proto_is_compact(buf, len) &&
+           proto_get32(buf, REFLECT_MAGIC_OFF) == DATA_MAGIC;
+}
+
+// turn the data message at buf into an ack of len bytes (at least
+// ACK_LEN), keeping its seq_num and timestamp
+static inline void proto_ack_init(void *buf, size_t len, uint32_t max_seq, uint64_t window)
+{
+    proto_put16(buf, PROTO_LEN_OFF, len);
+    proto_put32(buf, REFLECT_MAGIC_OFF, ACK_MAGIC);
+    proto_put32(buf, ACK_MAX_OFF, max_seq);
+    proto_put64(buf, ACK_WINDOW_OFF, window);
+}
+
+static inline int proto_is_ack(const void *buf, size_t len)
+{
+    return len >= ACK_LEN && !proto_is_compact(buf, len) &&
+           proto_get32(buf, REFLECT_MAGIC_OFF) == ACK_MAGIC;
+}
+
+static inline uint32_t proto_ack_max(const void *buf) { return proto_get32(buf, ACK_MAX_OFF); }
+static inline uint64_t proto_ack_window(const void *buf) { return proto_get64(buf, ACK_WINDOW_OFF); }
+
+static inline void proto_hello_init(void *buf, uint64_t ts_us)
+{
+    proto_set_header(buf, PROTO_HELLO_LEN, 0, ts_us);
+    proto_put32(buf, PROTO_HDRLEN, PROTO_HELLO);
+    ((uint8_t *)buf)[PROTO_HDRLEN + 4] = PROTO_COMPACT_V1;
+    ((uint8_t *)buf)[PROTO_HDRLEN + 5] = 0;
+}
+
+static inline int proto_is_hello(const void *buf, size_t len)
+{
+    return len >= PROTO_HELLO_LEN && !proto_is_compact(buf, len) && proto_seq(buf) == 0 &&
+           proto_get32(buf, PROTO_HDRLEN) == PROTO_HELLO;
+}
+
+// the server's side: take the client's version if we speak it
+static inline void proto_hello_accept(void *buf)
+{
+    uint8_t *v = (uint8_t *)buf + PROTO_HDRLEN + 4;
+
+    v[1] = v[0] >= PROTO_COMPACT_V1 ? PROTO_COMPACT_V1 : 0;
+}
+
+static inline int proto_hello_accepted(const void *buf)
+{
+    return ((const uint8_t *)buf)[PROTO_HDRLEN + 5];
+}
+
+// one direction of a compact flow: the sync message of its current epoch
+struct proto_sync {
+    uint32_t seq;
+    uint64_t ts_us;
+    uint8_t epoch;
+    uint8_t valid;
+};
+
+// whether the next message has to be a sync: the first one, or one that
+// can't be told as a forward step from the last sync
+static inline int proto_must_sync(const struct proto_sync *s, uint32_t seq, uint64_t ts_us)
+{
+    return !s->valid || (int32_t)(seq - s->seq) < 0 || ts_us < s->ts_us;
+}
+
+// total length of a compact message with body bytes after its header
+static inline size_t proto_compact_len(const struct proto_sync *s, int sync, uint32_t seq,
+                                       uint64_t ts_us, size_t body)
+{
+    size_t fixed = 2 + (sync ? proto_varint_len(seq) + proto_varint_len(ts_us)
+                             : proto_varint_len(seq - s->seq) +
+                               proto_varint_len(ts_us - s->ts_us));
+    size_t n = fixed + 1 + body;
+
+    // the length counts its own varint
+    while (fixed + proto_varint_len(n) + body != n)
+        n = fixed + proto_varint_len(n) + body;
+    return n;
+}
+
+// write the compact header of a len byte message into buf (room for
+// PROTO_COMPACT_MAX) and return its size. a sync starts the next epoch in
+// s, so a sync that never goes out has to be followed by another.
+static inline size_t proto_compact_put(struct proto_sync *s, void *buf, size_t len, int sync,
+                                       uint32_t seq, uint64_t ts_us)
+{
+    uint8_t *p = buf;
+    size_t n = 2;
+
+    if (sync) {
+        s->epoch = (s->epoch + 1) % PROTO_EPOCHS;
+        s->seq = seq;
+        s->ts_us = ts_us;
+        s->valid = 1;
+    }
+    p[0] = PROTO_COMPACT;
+    p[1] = (sync ? PROTO_SYNC : 0) | s->epoch;
+    n += proto_put_varint(p + n, len);
+    n += proto_put_varint(p + n, sync ? seq : (uint32_t)(seq - s->seq));
+    n += proto_put_varint(p + n, sync ? ts_us : ts_us - s->ts_us);
+    return n;
+}
+
+// read the compact header of a len byte message against s, which a sync
+// moves on to its epoch (unless it is a late one from an older epoch).
+// returns the header's size, 0 if it is malformed, -1 if it belongs to an
+// epoch whose sync we never saw.
+static inline int proto_compact_get(struct proto_sync *s, const void *buf, size_t len,
+                                    uint32_t *seq, uint64_t *ts_us)
+{
+    const uint8_t *p = buf, *end = p + len;
+    uint64_t n, sv, tv;
+    size_t a, b, c;
+    uint8_t epoch;
+
+    if (!proto_is_compact(buf, len) || len < PROTO_COMPACT_MIN ||
+        (a = proto_get_varint(p + 2, end, &n)) == 0 ||
+        (b = proto_get_varint(p + 2 + a, end, &sv)) == 0 ||
+        (c = proto_get_varint(p + 2 + a + b, end, &tv)) == 0)
+        return 0;
+    epoch = p[1] & (PROTO_EPOCHS - 1);
+    if (p[1] & PROTO_SYNC) {
+        if (!s->valid || ((epoch - s->epoch) & (PROTO_EPOCHS - 1)) < PROTO_EPOCHS / 2) {
+            s->epoch = epoch;
+            s->seq = sv;
+            s->ts_us = tv;
+            s->valid = 1;
+        }
+        *seq = sv;
+        *ts_us = tv;
+    } else if (s->valid && s->epoch == epoch) {
+        *seq = s->seq + (uint32_t)sv;
+        *ts_us = s->ts_us + tv;
+    } else {
+        return -1;
+    }
+    return 2 + a + b + c;
+}
+
+// fill in the trailer of a finished datagram of len bytes, which has
+// CRC_TRAILER bytes to spare at the end. anything that changes the
+// datagram afterwards (the reflector's stamps) has to seal it again.
+static inline void proto_crc_seal(void *buf, size_t len)
+{
+    proto_put32(buf, len - CRC_TRAILER, CRC_MAGIC);
+    proto_put32(buf, len - 4, crc32c(buf, len - 4));
+}
+
+static inline void proto_crc_seal_batch(struct mmsghdr *msgs, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        struct iovec *iov = msgs[i].msg_hdr.msg_iov;
+        proto_crc_seal(iov->iov_base, iov->iov_len);
+    }
+}
+
+// CRC_NONE if the datagram has no trailer (or a flipped bit in its magic
+// hides it), CRC_OK or CRC_BAD otherwise
+static inline int proto_crc_check(const void *buf, size_t len)
+{
+    size_t hdr = proto_is_compact(buf, len) ? PROTO_COMPACT_MIN : PROTO_HDRLEN;
+
+    if (len < hdr + CRC_TRAILER || proto_get32(buf, len - CRC_TRAILER) != CRC_MAGIC)
+        return CRC_NONE;
+    return proto_get32(buf, len - 4) == crc32c(buf, len - 4) ? CRC_OK : CRC_BAD;
+}
+
+#endif
@@ -1,42 +1,749 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/un.h>
+#include <linux/sock_diag.h>
+
+#include "hist.h"
+#include "proto.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING 1
+#endif
+#endif
+#endif
 
 #define PORT "10010"
 #define MAXBUFLEN 1038  // max message size
+#define MAXBATCH 1024   // max datagrams per recvmmsg/sendmmsg call
+#define MAXGROLEN 65535 // max size of a GRO-coalesced super-buffer
+#define MAXDGRAM 65507  // largest UDP payload over IPv4 (-M)
+#define MAXWORKERS 256
+#define LOGRING 4096    // log records buffered per worker, power of 2
+#define SEQWINDOW 64    // seq_nums behind the newest that dup/reorder can tell apart
+#define SEQRESTART 1024 // a seq_num this far behind the newest is a restarted sender
+#define BUCKETS 4096    // per-source rate limit slots, shared by the workers; power of 2
+#define SHEDBATCH 64    // datagrams discarded per recvmmsg while shedding
+
+enum echo_mode {
+    MODE_PLAIN,  // one recvfrom + one sendto per datagram
+    MODE_MMSG,   // up to batch datagrams per recvmmsg + sendmmsg
+    MODE_URING   // io_uring multishot recvmsg + linked sends
+};
+
+struct server_config {
+    enum echo_mode mode;
+    int batch;       // datagrams per recvmmsg call / io_uring send chain
+    long timeout_us; // how long a batch may wait to fill, 0 = return on first
+    int quiet;       // no per-datagram logging at all
+    int log_every;   // log every Nth echo event
+    int log_rate;    // at most this many log lines per second, 0 = no cap
+    int workers;     // echo threads, each with its own SO_REUSEPORT socket
+    int cpus[MAXWORKERS]; // worker i is pinned to cpus[i % ncpus]
+    int ncpus;       // 0 = don't pin
+    int report_secs; // print merged counters this often, 0 = only on exit
+    int gro;         // UDP_GRO on receive, echo super-buffers with UDP_SEGMENT
+    int flows;       // flow table slots per worker (power of 2), 0 = off
+    int reflect;     // stamp rx/tx times into reflector headers (proto.h)
+    long busy_us;    // spin on non-blocking receives this long before blocking, 0 = off
+    double rate;     // per-source datagrams per second, 0 = no limit
+    double burst;    // per-source bucket depth
+    int overload;    // shed when the receive queue is this % of SO_RCVBUF, 0 = off
+    const char *stats_path; // UNIX socket serving snapshots, NULL = none
+    int maxlen;      // longest datagram echoed whole; longer ones are cut to this
+};
+
+// written only by the owning worker, read by the reporter
+struct worker_stats {
+    uint64_t rx_pkts;
+    uint64_t rx_bytes;
+    uint64_t tx_pkts;
+    uint64_t errors;
+    uint64_t untracked; // datagrams from sources that didn't fit in the flow table
+    uint64_t busy_sleeps; // -p: times the spin window ran out and we blocked
+    uint64_t limited;   // -s: dropped because the source was over its rate
+    uint64_t shed;      // -o: discarded unread while the receive queue was too long
+    uint64_t overloads; // -o: times the worker went into shedding
+    uint64_t rxq_ovfl;  // kernel's SO_RXQ_OVFL count: dropped before we could read them
+    uint64_t crc_ok;    // messages whose CRC32C trailer checked out
+    uint64_t crc_bad;   // ... and didn't: corrupted on the way in
+    uint64_t compact;   // messages with the compact header (tracked flows only)
+    uint64_t unsynced;  // ... whose epoch's sync message never arrived
+};
+
+
+// one client as seen by one worker, sized to one cache line. keyed on the
+// source address and port; port 0 marks an empty slot since no UDP sender
+// can use it.
+struct flow {
+    uint32_t addr;      // network order, as in sin_addr
+    uint16_t port;      // network order, 0 = empty
+    uint8_t has_seq;
+    uint8_t sync;       // compact header: PROTO_SYNC | epoch of the last sync, 0 = none
+    uint32_t max_seq;   // newest seq_num seen
+    uint32_t lost;      // seq_nums skipped over and not (yet) seen
+    uint64_t window;    // bit i set = max_seq - i was seen
+    uint64_t pkts;      // messages, which is datagrams unless clients coalesce
+    uint64_t bytes;
+    uint32_t gaps;      // times the seq_num jumped ahead by more than one
+    uint32_t reorders;  // arrived after a newer seq_num
+    uint32_t dups;      // seq_num seen twice within the window
+    uint32_t sync_seq;  // compact header: the last sync's seq_num
+    uint32_t restarts;  // times the seq_num went back past SEQRESTART
+} __attribute__((aligned(64)));
+
+// per-source token bucket, keyed on the address alone so a client can't
+// dodge its limit by spreading over ports. SO_REUSEPORT hands a source's
+// ports to different workers, so the workers share one table and take a
+// bucket's lock to charge it. refilled lazily from the time since it was
+// last charged, so idle sources cost nothing.
+struct bucket {
+    uint32_t addr;    // network order
+    uint32_t used;    // 0 = free, 1 = being claimed, 2 = addr is set
+    uint32_t lock;
+    double tokens;
+    uint64_t last_ns;
+    uint64_t dropped;
+};
+
+struct worker {
+    int id;
+    int sockfd;
+    int cpu; // -1 = not pinned
+    pthread_t thread;
+    const struct server_config *cfg;
+    struct log_ring *log; // NULL with -q
+    struct flow *flows;   // NULL with -F 0
+    struct bucket *buckets; // NULL without -s; BUCKETS slots + 1 for overflow, shared
+    struct worker_stats stats;
+    struct hist svc;      // recv-to-send service time per datagram
+} __attribute__((aligned(64))); // keep each worker's counters on its own cache lines
+
+enum log_event {
+    LOG_ECHO,  // one datagram echoed (plain loop)
+    LOG_BATCH  // a batch of datagrams echoed (mmsg / uring loops)
+};
+
+// fixed-size record; formatting happens on the logger thread
+struct log_rec {
+    uint64_t ns;
+    uint16_t event;
+    uint32_t count;    // a GRO batch can hold more than 65535 segments
+    uint32_t bytes;
+    struct sockaddr_in peer;
+};
 
-#pragma pack(1)
-typedef struct {
-    uint16_t length;     
-    uint32_t seq_num;    
-    uint64_t timestamp;  
-    char message[1024];  
-} protocol_msg_t;
-#pragma pack()
+// single-producer single-consumer ring: the owning worker is the only
+// writer of tail, the logger thread the only writer of head, so neither
+// side needs a lock and a full ring costs the worker one dropped record
+struct log_ring {
+    unsigned tail __attribute__((aligned(64)));
+    uint64_t seen;      // echo events offered, for every-Nth sampling
+    uint64_t skipped;   // sampled or rate-limited out
+    uint64_t dropped;   // ring was full
+    double tokens;      // rate limit bucket, this worker's share of -L
+    uint64_t last_ns;
+    unsigned head __attribute__((aligned(64)));
+    uint64_t logged;
+    struct log_rec recs[LOGRING];
+};
+
+// single writer, so a relaxed load + store is enough and avoids a locked add
+#define STAT_ADD(w, field, n) \
+    __atomic_store_n(&(w)->stats.field, (w)->stats.field + (n), __ATOMIC_RELAXED)
+#define RING_ADD(l, field, n) \
+    __atomic_store_n(&(l)->field, (l)->field + (n), __ATOMIC_RELAXED)
+#define FLOW_SET(f, field, v) \
+    __atomic_store_n(&(f)->field, (v), __ATOMIC_RELAXED)
+
+static struct worker workers[MAXWORKERS];
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t dump;
+static uint64_t start_ns;
+static int stats_fd = -1;
+
+void usage(void)
+{
+    fprintf(stderr, "usage: server11 [-m plain|mmsg|uring] [-b batch] [-t timeout_us] [-q]\n");
+    fprintf(stderr, "                [-w workers] [-c cpulist] [-r report_secs] [-g]\n");
+    fprintf(stderr, "                [-l every_n] [-L lines_per_sec] [-F flows] [-R] [-p busy_us]\n");
+    fprintf(stderr, "                [-s pps[:burst]] [-o pct] [-S stats_socket] [-M bytes]\n");
+    fprintf(stderr, "  -m  echo loop: plain recvfrom/sendto (default), batched recvmmsg/sendmmsg,\n");
+    fprintf(stderr, "      or io_uring (falls back to plain if the kernel can't)\n");
+    fprintf(stderr, "  -b  datagrams per batch in mmsg mode / per send chain in uring mode\n");
+    fprintf(stderr, "      (1-%d, default 64)\n", MAXBATCH);
+    fprintf(stderr, "  -t  usec a batch may wait to fill in mmsg mode (default 0 = return on first)\n");
+    fprintf(stderr, "  -q  quiet, no per-datagram logging\n");
+    fprintf(stderr, "  -l  log only every Nth echo event (default 1 = all)\n");
+    fprintf(stderr, "  -L  log at most this many lines per second (default 0 = no cap)\n");
+    fprintf(stderr, "  -F  per-client flow table slots per worker, power of 2 (default 4096,\n");
+    fprintf(stderr, "      0 = off); kill -USR1 prints the table\n");
+    fprintf(stderr, "  -R  reflector mode: stamp receive/transmit times into datagrams that\n");
+    fprintf(stderr, "      carry the reflector header (clients run with -T)\n");
+    fprintf(stderr, "  -p  plain/mmsg only: busy-poll, spinning on non-blocking receives for\n");
+    fprintf(stderr, "      about busy_us after the last datagram before blocking again\n");
+    fprintf(stderr, "  -s  echo at most pps datagrams per second per source address, with\n");
+    fprintf(stderr, "      bursts up to burst (default pps); the limit is per worker\n");
+    fprintf(stderr, "  -o  plain/mmsg only: when the receive queue passes pct%% of SO_RCVBUF,\n");
+    fprintf(stderr, "      discard the oldest datagrams unread until it is under half that\n");
+    fprintf(stderr, "  -M  plain/mmsg only: echo datagrams of up to this many bytes whole\n");
+    fprintf(stderr, "      (default %d, up to %d); longer ones are cut short\n", MAXBUFLEN - 1, MAXDGRAM);
+    fprintf(stderr, "  -w  echo threads, each on its own SO_REUSEPORT socket (1-%d, default 1)\n", MAXWORKERS);
+    fprintf(stderr, "  -c  cpus to pin workers to, e.g. 0-3,6 (round-robin over the list)\n");
+    fprintf(stderr, "  -r  print merged counters every report_secs (default 0 = only on exit)\n");
+    fprintf(stderr, "  -S  serve a counter and service-time snapshot to every connection on\n");
+    fprintf(stderr, "      this UNIX socket path\n");
+    fprintf(stderr, "  -g  mmsg mode only: receive coalesced UDP_GRO buffers and echo them\n");
+    fprintf(stderr, "      with UDP_SEGMENT (GSO), keeping the original segment boundaries\n");
+    exit(1);
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// called on the hot path: apply sampling, then hand a fixed-size record to
+// the logger thread. never blocks and never touches stdio.
+void log_echo(struct worker *w, int event, int count, size_t bytes,
+              const struct sockaddr_storage *peer)
+{
+    struct log_ring *l = w->log;
+    const struct server_config *cfg = w->cfg;
+    struct log_rec *rec;
+    uint64_t now = 0;
+
+    if (l == NULL)
+        return;
+
+    if (++l->seen % cfg->log_every != 0) {
+        RING_ADD(l, skipped, 1);
+        return;
+    }
+
+    // -L is for the whole server, so each worker gets an equal share
+    // (and room for at least one line, however many workers there are)
+    if (cfg->log_rate > 0) {
+        double rate = (double)cfg->log_rate / cfg->workers;
+        now = now_ns();
+        l->tokens += (now - l->last_ns) * 1e-9 * rate;
+        if (l->tokens > (rate > 1 ? rate : 1))
+            l->tokens = rate > 1 ? rate : 1;
+        l->last_ns = now;
+        if (l->tokens < 1) {
+            RING_ADD(l, skipped, 1);
+            return;
+        }
+        l->tokens -= 1;
+    }
+
+    if (l->tail - __atomic_load_n(&l->head, __ATOMIC_ACQUIRE) == LOGRING) {
+        RING_ADD(l, dropped, 1);
+        return;
+    }
+
+    rec = &l->recs[l->tail & (LOGRING - 1)];
+    rec->ns = now ? now : now_ns();
+    rec->event = event;
+    rec->count = count;
+    rec->bytes = bytes;
+    memcpy(&rec->peer, peer, sizeof rec->peer);
+    __atomic_store_n(&l->tail, l->tail + 1, __ATOMIC_RELEASE);
+}
+
+// background thread: drain every worker's ring into stdout, then sleep a
+// little when there was nothing to do
+void *logger_main(void *arg)
+{
+    int nworkers = *(int *)arg;
+    char ip[INET_ADDRSTRLEN];
+    struct timespec idle = { 0, 10 * 1000000 };
+
+    while (1) {
+        int drained = 0;
+
+        for (int i = 0; i < nworkers; i++) {
+            struct log_ring *l = workers[i].log;
+            unsigned head = l->head;
+            unsigned tail = __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail; head++) {
+                struct log_rec *rec = &l->recs[head & (LOGRING - 1)];
+                double t = (rec->ns - start_ns) * 1e-9;
+
+                inet_ntop(AF_INET, &rec->peer.sin_addr, ip, sizeof ip);
+                if (rec->event == LOG_ECHO)
+                    printf("[%.6f] server: received %u bytes from %s:%d, echoed back\n",
+                           t, rec->bytes, ip, ntohs(rec->peer.sin_port));
+                else
+                    printf("[%.6f] server: received %u datagrams (%u bytes) from clients, echoed back\n",
+                           t, rec->count, rec->bytes);
+                drained++;
+            }
+            __atomic_store_n(&l->logged, l->logged + (tail - l->head), __ATOMIC_RELAXED);
+            __atomic_store_n(&l->head, head, __ATOMIC_RELEASE);
+        }
+
+        if (drained)
+            fflush(stdout);
+        else
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+// find or claim the slot for this source. open addressing with linear
+// probing over a table allocated up front, so the hot path never allocates;
+// once every slot is taken new sources just go untracked.
+struct flow *flow_lookup(struct worker *w, const struct sockaddr_storage *from)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)from;
+    unsigned mask = w->cfg->flows - 1;
+    uint64_t key = (uint64_t)sin->sin_addr.s_addr << 16 | sin->sin_port;
+    unsigned i = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+    if (from->ss_family != AF_INET || sin->sin_port == 0)
+        return NULL;
+
+    for (unsigned n = 0; n <= mask; n++, i++) {
+        struct flow *f = &w->flows[i & mask];
+
+        if (f->port == sin->sin_port && f->addr == sin->sin_addr.s_addr)
+            return f;
+        if (f->port == 0) {
+            f->addr = sin->sin_addr.s_addr;
+            // publish the key last so the exporter never sees half of it
+            __atomic_store_n(&f->port, sin->sin_port, __ATOMIC_RELEASE);
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// account one message against its flow. anything too short for a
+// seq_num, or with a compact header we can't decode, only counts bytes.
+void flow_seq(struct worker *w, struct flow *f, const char *buf, size_t len)
+{
+    uint32_t seq = 0;
+    int32_t d;
+
+    FLOW_SET(f, pkts, f->pkts + 1);
+    FLOW_SET(f, bytes, f->bytes + len);
+    if (proto_is_compact(buf, len)) {
+        // the decoder state lives in the flow; the timestamp isn't kept
+        struct proto_sync s = { f->sync_seq, 0, f->sync & (PROTO_EPOCHS - 1), f->sync != 0 };
+        uint64_t ts;
+        int rv = proto_compact_get(&s, buf, len, &seq, &ts);
+
+        f->sync_seq = s.seq;
+        f->sync = s.valid ? PROTO_SYNC | s.epoch : 0;
+        STAT_ADD(w, compact, 1);
+        if (rv == -1)
+            STAT_ADD(w, unsynced, 1);
+        if (rv <= 0)
+            return;
+    } else if (len < PROTO_TS_OFF) {
+        return;
+    } else {
+        seq = proto_seq(buf);
+    }
+
+    if (!f->has_seq) {
+        f->has_seq = 1;
+        f->max_seq = seq;
+        f->window = 1;
+        return;
+    }
+
+    d = (int32_t)(seq - f->max_seq);
+    if (d > 0) {
+        if (d > 1) {
+            FLOW_SET(f, gaps, f->gaps + 1);
+            FLOW_SET(f, lost, f->lost + (d - 1));
+        }
+        f->window = d >= SEQWINDOW ? 1 : f->window << d | 1;
+        FLOW_SET(f, max_seq, seq);
+    } else if (-d >= SEQRESTART) {
+        // the sender started over (a new run from the same port): go on
+        // from its new seq_num rather than count all of it as reordered
+        FLOW_SET(f, restarts, f->restarts + 1);
+        f->window = 1;
+        FLOW_SET(f, max_seq, seq);
+    } else if (-d < SEQWINDOW && (f->window >> -d & 1)) {
+        FLOW_SET(f, dups, f->dups + 1);
+    } else {
+        // an older seq_num we hadn't seen: it was counted lost when we
+        // skipped over it, so take it back off
+        if (-d < SEQWINDOW)
+            f->window |= 1ULL << -d;
+        FLOW_SET(f, reorders, f->reorders + 1);
+        if (f->lost > 0)
+            FLOW_SET(f, lost, f->lost - 1);
+    }
+}
+
+// returns the source's flow, NULL if it isn't tracked
+struct flow *flow_update(struct worker *w, const struct sockaddr_storage *from,
+                         const char *buf, size_t len, size_t seg)
+{
+    struct flow *f;
+
+    if (w->flows == NULL)
+        return NULL;
+    if ((f = flow_lookup(w, from)) == NULL) {
+        STAT_ADD(w, untracked, 1);
+        return NULL;
+    }
+    // a GRO super-buffer carries one datagram per segment, and a datagram
+    // can carry several messages
+    for (size_t off = 0; off < len; off += seg) {
+        size_t end = len - off < seg ? len : off + seg;
+
+        for (size_t at = off, n; at < end; at += n)
+            flow_seq(w, f, buf + at, (n = proto_next(buf + at, end - at)));
+    }
+    return f;
+}
+
+// charge n datagrams to the source's bucket; 0 means drop them. sources
+// that don't fit in the table share the last bucket, so a spoofed flood
+// can't get around the limit by filling the table first.
+int admit(struct worker *w, const struct sockaddr_storage *from, int n, uint64_t now)
+{
+    const struct server_config *cfg = w->cfg;
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)from;
+    uint32_t addr = sin->sin_addr.s_addr;
+    unsigned i = (addr * 0x9e3779b97f4a7c15ULL) >> 32;
+    struct bucket *b;
+
+    if (w->buckets == NULL)
+        return 1;
+
+    b = &w->buckets[BUCKETS];
+
+    for (unsigned k = 0; k < BUCKETS; k++, i++) {
+        struct bucket *c = &w->buckets[i & (BUCKETS - 1)];
+        uint32_t used = __atomic_load_n(&c->used, __ATOMIC_ACQUIRE);
+
+        // claim a free slot, or (if another worker got there first) wait
+        // for its address to see whether it is ours
+        if (used == 0 &&
+            __atomic_compare_exchange_n(&c->used, &used, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            c->addr = addr;
+            c->tokens = cfg->burst;
+            c->last_ns = now;
+            __atomic_store_n(&c->used, 2, __ATOMIC_RELEASE);
+            b = c;
+            break;
+        }
+        while (used == 1)
+            used = __atomic_load_n(&c->used, __ATOMIC_ACQUIRE);
+        if (c->addr == addr) {
+            b = c;
+            break;
+        }
+    }
+
+    while (__atomic_exchange_n(&b->lock, 1, __ATOMIC_ACQUIRE))
+        ;
+    // another worker may have charged it with a later clock read
+    if (now > b->last_ns) {
+        b->tokens += (now - b->last_ns) * 1e-9 * cfg->rate;
+        if (b->tokens > cfg->burst)
+            b->tokens = cfg->burst;
+        b->last_ns = now;
+    }
+    if (b->tokens < n) {
+        __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&b->dropped, n, __ATOMIC_RELAXED);
+        STAT_ADD(w, limited, n);
+        return 0;
+    }
+    b->tokens -= n;
+    __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// how full the receive queue is, in percent of SO_RCVBUF. both sides
+// count skb truesize, so this is the same measure the kernel drops on.
+int backlog_pct(int sockfd)
+{
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t len = sizeof mem;
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_MEMINFO, mem, &len) == -1 ||
+        mem[SK_MEMINFO_RCVBUF] == 0)
+        return 0;
+    return (uint64_t)mem[SK_MEMINFO_RMEM_ALLOC] * 100 / mem[SK_MEMINFO_RCVBUF];
+}
+
+// -o: once the queue passes the high-water mark, throw away the oldest
+// datagrams until it is back under half of it. the receives have no
+// buffer, so the kernel frees each datagram without copying any of it,
+// and what is left to echo is fresh enough to still be a useful sample.
+void shed_backlog(struct worker *w)
+{
+    struct mmsghdr msgs[SHEDBATCH];
+    int hi = w->cfg->overload;
+    int n;
+
+    if (backlog_pct(w->sockfd) < hi)
+        return;
+
+    STAT_ADD(w, overloads, 1);
+    memset(msgs, 0, sizeof msgs);
+    do {
+        if ((n = recvmmsg(w->sockfd, msgs, SHEDBATCH, MSG_DONTWAIT, NULL)) <= 0)
+            break;
+        STAT_ADD(w, shed, n);
+    } while (backlog_pct(w->sockfd) >= hi / 2);
+}
+
+// parse a cpu list like "0-3,6,8-9" into cfg->cpus
+int parse_cpus(const char *list, struct server_config *cfg)
+{
+    char *end;
+    long lo, hi;
+
+    cfg->ncpus = 0;
+    while (*list) {
+        lo = hi = strtol(list, &end, 10);
+        if (end == list || lo < 0)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+            if (end == list || hi < lo)
+                return -1;
+        }
+        for (long c = lo; c <= hi; c++) {
+            if (cfg->ncpus == MAXWORKERS || c >= CPU_SETSIZE)
+                return -1;
+            cfg->cpus[cfg->ncpus++] = c;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        list = end;
+    }
+    return cfg->ncpus > 0 ? 0 : -1;
+}
+
+uint64_t wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-int main(void)
+// the kernel's SO_TIMESTAMPNS receive time if msg carries one, otherwise
+// the time we got to look at it
+uint64_t rx_timestamp(struct msghdr *msg)
 {
+    struct cmsghdr *cm;
+    struct timespec ts;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cm), sizeof ts);
+            return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+    }
+    return wall_ns();
+}
+
+// SO_RXQ_OVFL: after the kernel drops datagrams for a full receive queue,
+// the next ones to be queued carry its running drop count for the socket
+void rx_drops(struct worker *w, struct msghdr *msg)
+{
+    struct cmsghdr *cm;
+    uint32_t drops;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&drops, CMSG_DATA(cm), sizeof drops);
+            if (drops != w->stats.rxq_ovfl)
+                __atomic_store_n(&w->stats.rxq_ovfl, drops, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// go over every message in buf (one datagram per segment for GRO
+// buffers, and possibly several messages per datagram) before it is
+// echoed: check its CRC32C trailer if it has one, and with -R fill in the
+// receive and transmit stamps of a reflector header. a message that
+// checked out is sealed again over its new stamps; a corrupt one keeps
+// its bad CRC, so the client sees the mismatch too. messages without the
+// magics are echoed untouched. a compact header hello (proto.h) gets our
+// answer filled in.
+//
+// a reliable transfer's data message (client -y) is answered with an ack
+// instead, from f's seq_num window (or just its own seq_num if the flow
+// isn't tracked). alone in its datagram the ack replaces it, so the reply
+// is short; otherwise (GRO, or coalesced) it is written over the message
+// if that is long enough, keeping its length. returns how much of buf to
+// echo.
+size_t echo_fixup(struct worker *w, const struct flow *f, char *buf, size_t len, size_t seg,
+                  uint64_t rx_ns)
+{
+    uint64_t tx_ns = 0, ok = 0, bad = 0;
+    size_t reply = len;
+
+    for (size_t off = 0; off < len; off += seg) {
+        size_t end = len - off < seg ? len : off + seg;
+
+        for (size_t at = off, n; at < end; at += n) {
+            char *p = buf + at;
+            int crc;
+
+            n = proto_next(p, end - at);
+            crc = proto_crc_check(p, n);
+            ok += crc == CRC_OK;
+            bad += crc == CRC_BAD;
+            if (proto_is_hello(p, n)) {
+                proto_hello_accept(p);
+                if (crc == CRC_OK)
+                    proto_crc_seal(p, n);
+                continue;
+            }
+            if (crc != CRC_BAD && proto_is_data(p, n)) {
+                size_t alen = ACK_LEN + (crc == CRC_OK ? CRC_TRAILER : 0);
+
+                if (n == len && alen <= (size_t)w->cfg->maxlen)
+                    reply = n = alen;
+                if (n < alen)
+                    continue;
+                if (f != NULL)
+                    proto_ack_init(p, n, f->max_seq, f->window);
+                else
+                    proto_ack_init(p, n, proto_seq(p), 1);
+                if (crc == CRC_OK)
+                    proto_crc_seal(p, n);
+                // the rest of buf is the old message, not part of the reply
+                if (reply < len)
+                    goto done;
+                continue;
+            }
+            if (!w->cfg->reflect || !proto_is_reflect(p, n))
+                continue;
+            if (tx_ns == 0)
+                tx_ns = wall_ns();
+            proto_reflect_stamp(p, rx_ns, tx_ns);
+            if (crc == CRC_OK)
+                proto_crc_seal(p, n);
+        }
+    }
+done:
+    if (ok > 0)
+        STAT_ADD(w, crc_ok, ok);
+    if (bad > 0)
+        STAT_ADD(w, crc_bad, bad);
+    return reply;
+}
+
+// -p state for one worker
+struct busy_poll {
+    uint64_t idle_since; // first empty receive of the current idle spell, 0 = busy
+    uint64_t spin_ns;    // current spin window, adapted between min and max
+    uint64_t min_ns, max_ns;
+};
+
+// ask the kernel to busy-poll the device queue too. needs CAP_NET_ADMIN
+// above net.core.busy_read, so a refusal only costs a warning.
+void busy_poll_setup(struct worker *w, struct busy_poll *bp)
+{
+    int us = w->cfg->busy_us, on = 1;
+
+    if (setsockopt(w->sockfd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof us) == -1)
+        perror("server: setsockopt SO_BUSY_POLL");
+#ifdef SO_PREFER_BUSY_POLL
+    if (setsockopt(w->sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof on) == -1)
+        perror("server: setsockopt SO_PREFER_BUSY_POLL");
+#endif
+    (void)on;
+
+    bp->idle_since = 0;
+    bp->spin_ns = (uint64_t)us * 1000;
+    bp->min_ns = bp->spin_ns / 8;
+    bp->max_ns = bp->spin_ns * 8;
+}
+
+// a non-blocking receive came back empty. keep spinning until the socket
+// has been idle for the spin window, then block in poll() so an idle
+// server burns no CPU. the spin yields rather than pausing: with a
+// dedicated core sched_yield returns at once, but when a client shares the
+// core a pause loop holds it for a whole timeslice and wrecks the tail.
+// the window adapts: waking sooner than it would have expired means we
+// gave up too early, so it grows; sleeping past it means traffic is
+// sparse and spinning was wasted, so it shrinks.
+void busy_wait(struct worker *w, struct busy_poll *bp)
+{
+    struct pollfd pfd = { w->sockfd, POLLIN, 0 };
+    uint64_t now = now_ns(), slept;
+
+    if (bp->idle_since == 0)
+        bp->idle_since = now;
+    if (now - bp->idle_since < bp->spin_ns) {
+        sched_yield();
+        return;
+    }
+
+    STAT_ADD(w, busy_sleeps, 1);
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+        ;
+    slept = now_ns() - now;
+    if (slept < bp->spin_ns)
+        bp->spin_ns = bp->spin_ns * 2 < bp->max_ns ? bp->spin_ns * 2 : bp->max_ns;
+    else
+        bp->spin_ns = bp->spin_ns / 2 > bp->min_ns ? bp->spin_ns / 2 : bp->min_ns;
+    bp->idle_since = 0;
+}
+
+// create the UDP socket and bind it to PORT. with reuseport set, every
+// worker binds its own socket to the same port and the kernel spreads
+// incoming flows across them by 4-tuple hash. reflect turns on kernel
+// receive timestamps; the kernel's drop count is always asked for.
+int open_socket(int reuseport, int reflect)
+{
+    int yes = 1;
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr;
-    socklen_t addr_len;
     int rv;
-    char buf[MAXBUFLEN];
-    int numbytes;
+
     memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;      
-    hints.ai_socktype = SOCK_DGRAM; 
-    hints.ai_flags = AI_PASSIVE;    
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
 
     if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        return -1;
     }
 
     for(p = servinfo; p != NULL; p = p->ai_next) {
@@ -45,6 +752,24 @@ int main(void)
             continue;
         }
 
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                &yes, sizeof yes) == -1) {
+            close(sockfd);
+            perror("server: setsockopt SO_REUSEPORT");
+            continue;
+        }
+
+        if (reflect && setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS,
+                &yes, sizeof yes) == -1) {
+            close(sockfd);
+            perror("server: setsockopt SO_TIMESTAMPNS");
+            continue;
+        }
+
+        // only used for the drop counter, so carry on without it
+        if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof yes) == -1)
+            perror("server: setsockopt SO_RXQ_OVFL");
+
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(sockfd);
             perror("server: bind");
@@ -53,36 +778,1300 @@ int main(void)
         break;
     }
 
+    freeaddrinfo(servinfo);
+
     if (p == NULL) {
         fprintf(stderr, "server: failed to bind socket\n");
-        return 2;
+        return -1;
     }
 
-    freeaddrinfo(servinfo);
+    return sockfd;
+}
 
-    printf("UDP Echo Server: waiting for connections on port %s...\n", PORT);
+// control buffer big enough for the UDP_GRO cmsg (int), SO_TIMESTAMPNS and
+// SO_RXQ_OVFL (uint32_t) cmsgs on receive, and the UDP_SEGMENT cmsg
+// (uint16_t) on send
+#define CTRLLEN (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec)) + \
+                 CMSG_SPACE(sizeof(uint32_t)))
+
+// one recvmsg and one sendto per datagram
+void echo_plain(struct worker *w)
+{
+    int sockfd = w->sockfd;
+    struct sockaddr_storage their_addr;
+    socklen_t addr_len;
+    char *buf = malloc(w->cfg->maxlen);
+    char ctrl[CTRLLEN];
+    struct iovec iov = { buf, w->cfg->maxlen };
+    struct msghdr msg;
+    struct busy_poll bp = {0};
+    struct flow *f;
+    unsigned nrecv = 0;
+    int flags = 0;
+    int numbytes;
+    uint64_t t0;
+
+    if (buf == NULL) {
+        perror("server: malloc");
+        exit(1);
+    }
+    if (w->cfg->busy_us > 0) {
+        busy_poll_setup(w, &bp);
+        flags = MSG_DONTWAIT;
+    }
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_name = &their_addr;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
 
-    // Main server loop
     while(1) {
-        addr_len = sizeof their_addr;
-        
-        if ((numbytes = recvfrom(sockfd, buf, MAXBUFLEN-1, 0,
-                (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-            perror("recvfrom");
+        // recvmsg rather than recvfrom for the kernel's timestamp and
+        // drop count
+        msg.msg_namelen = sizeof their_addr;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof ctrl;
+
+        if ((numbytes = recvmsg(sockfd, &msg, flags)) == -1) {
+            if (flags && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                busy_wait(w, &bp);
+                continue;
+            }
+            perror("recvmsg");
+            STAT_ADD(w, errors, 1);
             continue;
         }
+        addr_len = msg.msg_namelen;
+        bp.idle_since = 0;
+        t0 = now_ns();
+        rx_drops(w, &msg);
 
-        printf("server: received %d bytes from client\n", numbytes);
+        STAT_ADD(w, rx_pkts, 1);
+        STAT_ADD(w, rx_bytes, numbytes);
+        // one receive at a time tells us nothing about the queue behind
+        // it, so look every 16th
+        if (w->cfg->overload > 0 && (++nrecv & 15) == 0)
+            shed_backlog(w);
+        if (!admit(w, &their_addr, 1, t0))
+            continue;
+        f = flow_update(w, &their_addr, buf, numbytes, numbytes);
+        numbytes = echo_fixup(w, f, buf, numbytes, numbytes,
+                              w->cfg->reflect ? rx_timestamp(&msg) : 0);
 
         if (sendto(sockfd, buf, numbytes, 0,
                 (struct sockaddr *)&their_addr, addr_len) == -1) {
             perror("sendto");
+            STAT_ADD(w, errors, 1);
+            continue;
+        }
+
+        STAT_ADD(w, tx_pkts, 1);
+        hist_add(&w->svc, now_ns() - t0, 1);
+        log_echo(w, LOG_ECHO, 1, numbytes, &their_addr);
+    }
+}
+
+// after recvmmsg: pull the GRO segment size out of msg's control data and
+// rewrite the control data into the matching UDP_SEGMENT cmsg for the echo.
+// returns how many datagrams the buffer holds; *seg gets their size.
+int gro_to_gso(struct msghdr *msg, size_t len, size_t *seg_size)
+{
+    struct cmsghdr *cm;
+    int gso_size = 0;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof gso_size);
+    }
+
+    if (gso_size <= 0 || len <= (size_t)gso_size) {
+        msg->msg_controllen = 0;
+        *seg_size = len;
+        return 1;
+    }
+    *seg_size = gso_size;
+
+    // every segment but the last is exactly gso_size, so segmenting the
+    // echo at the same size puts the boundaries (and with them each
+    // header's seq_num) back where the sender had them
+    uint16_t seg = gso_size;
+    msg->msg_controllen = CMSG_SPACE(sizeof seg);
+    cm = CMSG_FIRSTHDR(msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof seg);
+    memcpy(CMSG_DATA(cm), &seg, sizeof seg);
+    return (len + gso_size - 1) / gso_size;
+}
+
+// the kernel (or NIC) refused a GSO send; echo the segments one by one
+int send_segments(int sockfd, struct msghdr *msg, size_t len)
+{
+    struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+    char *p = msg->msg_iov[0].iov_base;
+    uint16_t seg;
+    int sent = 0;
+
+    memcpy(&seg, CMSG_DATA(cm), sizeof seg);
+    for (size_t off = 0; off < len; off += seg) {
+        size_t n = len - off < seg ? len - off : seg;
+        if (sendto(sockfd, p + off, n, 0, msg->msg_name, msg->msg_namelen) == -1) {
+            perror("sendto");
             continue;
         }
+        sent++;
+    }
+    return sent;
+}
+
+// pull up to cfg->batch datagrams per recvmmsg and echo them all back with
+// one sendmmsg. each mmsghdr keeps its own source address, so replies go to
+// whoever sent that particular datagram.
+void echo_mmsg(struct worker *w)
+{
+    const struct server_config *cfg = w->cfg;
+    int sockfd = w->sockfd;
+    char *bufs, *ctrls;
+    struct sockaddr_storage *addrs;
+    struct iovec *iovs;
+    struct mmsghdr *msgs;
+    int *segs;
+    struct timespec timeout, *tp = NULL;
+    int flags = MSG_WAITFORONE;
+    struct busy_poll bp = {0};
+    struct flow *f;
+    int batch = cfg->batch;
+    size_t buflen = cfg->gro ? MAXGROLEN : cfg->maxlen;
+    int n, k, sent, rv, nsegs;
+    size_t bytes, seg;
+    uint64_t rx_ns = 0, now = 0;
+
+    // per worker, so batches from different threads never share buffers
+    bufs = malloc(batch * buflen);
+    addrs = calloc(batch, sizeof *addrs);
+    iovs = calloc(batch, sizeof *iovs);
+    msgs = calloc(batch, sizeof *msgs);
+    segs = calloc(batch, sizeof *segs);
+    ctrls = calloc(batch, CTRLLEN);
+    if (bufs == NULL || addrs == NULL || iovs == NULL || msgs == NULL ||
+        segs == NULL || ctrls == NULL) {
+        perror("server: malloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < batch; i++) {
+        iovs[i].iov_base = bufs + i * buflen;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_control = ctrls + i * CTRLLEN;
+        segs[i] = 1;
+    }
+
+    if (cfg->gro) {
+        int on = 1;
+        if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof on) == -1) {
+            perror("server: setsockopt UDP_GRO");
+            exit(1);
+        }
+    }
+
+    if (cfg->timeout_us > 0) {
+        // without MSG_WAITFORONE every datagram after the first blocks for up
+        // to SO_RCVTIMEO, and the recvmmsg timeout caps the batch as a whole,
+        // so the oldest datagram in a batch waits at most about 2x timeout_us
+        struct timeval tv;
+        tv.tv_sec = cfg->timeout_us / 1000000;
+        tv.tv_usec = cfg->timeout_us % 1000000;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-        printf("server: echoed message back to client\n");
+        timeout.tv_sec = tv.tv_sec;
+        timeout.tv_nsec = tv.tv_usec * 1000;
+        tp = &timeout;
+        flags = 0;
     }
 
-    close(sockfd);
+    // busy-polling takes whatever is queued right now; there is no batch
+    // timeout to wait out
+    if (cfg->busy_us > 0) {
+        busy_poll_setup(w, &bp);
+        tp = NULL;
+        flags = MSG_DONTWAIT;
+    }
+
+    while(1) {
+        // recvmmsg overwrites these with what it actually got
+        for (int i = 0; i < batch; i++) {
+            iovs[i].iov_len = buflen;
+            msgs[i].msg_hdr.msg_namelen = sizeof addrs[i];
+            msgs[i].msg_hdr.msg_controllen = CTRLLEN;
+        }
+
+        if ((n = recvmmsg(sockfd, msgs, batch, flags, tp)) == -1) {
+            if (cfg->busy_us > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                busy_wait(w, &bp);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvmmsg");
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                STAT_ADD(w, errors, 1);
+            continue;
+        }
+
+        // echo back exactly what came in
+        bp.idle_since = 0;
+        bytes = 0;
+        nsegs = 0;
+        k = 0;
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            struct msghdr *h = &msgs[i].msg_hdr;
+            char *p = h->msg_iov->iov_base;
+
+            h->msg_iov->iov_len = msgs[i].msg_len;
+            seg = msgs[i].msg_len;
+            // read the receive time and drop count before gro_to_gso reuses
+            // the control buffer for the send side, and never send them back
+            rx_drops(w, h);
+            if (cfg->reflect)
+                rx_ns = rx_timestamp(h);
+            if (cfg->gro)
+                segs[i] = gro_to_gso(h, msgs[i].msg_len, &seg);
+            else
+                h->msg_controllen = 0;
+            if (!admit(w, h->msg_name, segs[i], now)) {
+                STAT_ADD(w, rx_pkts, segs[i]);
+                STAT_ADD(w, rx_bytes, msgs[i].msg_len);
+                continue;
+            }
+            bytes += msgs[i].msg_len;
+            nsegs += segs[i];
+            f = flow_update(w, h->msg_name, p, msgs[i].msg_len, seg);
+            h->msg_iov->iov_len = echo_fixup(w, f, p, msgs[i].msg_len, seg, rx_ns);
+
+            // pack what we echo at the front, in order. each mmsghdr points
+            // at its own iov/name/control, so swapping whole headers keeps
+            // every buffer in use exactly once
+            if (k != i) {
+                struct mmsghdr t = msgs[k];
+                msgs[k] = msgs[i];
+                msgs[i] = t;
+                segs[k] = segs[i];
+            }
+            k++;
+        }
+        STAT_ADD(w, rx_pkts, nsegs);
+        STAT_ADD(w, rx_bytes, bytes);
+        // a full batch means more is likely queued behind it
+        if (cfg->overload > 0 && n == batch)
+            shed_backlog(w);
+        if ((n = k) == 0)
+            continue;
+
+        for (sent = 0; sent < n; sent += rv) {
+            if ((rv = sendmmsg(sockfd, msgs + sent, n - sent, 0)) == -1) {
+                if (segs[sent] > 1 && (errno == EIO || errno == EINVAL)) {
+                    STAT_ADD(w, tx_pkts, send_segments(sockfd, &msgs[sent].msg_hdr,
+                                                       msgs[sent].msg_len));
+                } else {
+                    perror("sendmmsg");
+                    STAT_ADD(w, errors, 1);
+                }
+                // skip the datagram that failed and keep going
+                rv = 1;
+                continue;
+            }
+            for (int i = sent; i < sent + rv; i++)
+                STAT_ADD(w, tx_pkts, segs[i]);
+        }
+        // every datagram in the batch waited from the recvmmsg return to
+        // the end of the sendmmsg
+        hist_add(&w->svc, now_ns() - now, nsegs);
+
+        log_echo(w, LOG_BATCH, nsegs, bytes, msgs[0].msg_hdr.msg_name);
+    }
+}
+
+#ifdef HAVE_URING
+#define URING_NBUFS 4096 // provided buffers, must be a power of 2
+#define URING_BUFSZ 2048 // recvmsg_out + sockaddr + cmsgs + payload
+#define URING_NAMELEN sizeof(struct sockaddr_storage)
+
+// user_data layout: type in the top bits, whether the send used the fixed
+// buffer, then the bid of the datagram
+#define UD_RECV (1ULL << 62)
+#define UD_SEND (2ULL << 62)
+#define UD_FIXED (1ULL << 61)
+#define UD_TYPE(ud) ((ud) & (3ULL << 62))
+#define UD_BID(ud) ((ud) & 0xffff)
+
+struct uring {
+    int fd;
+    unsigned features;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;      // our copy of the SQ tail, published on submit
+    unsigned submitted;
+
+    char *bufs;             // URING_NBUFS x URING_BUFSZ, also fixed buffer 0
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    int fixed;              // sends use the registered buffer
+    size_t ctrllen;         // cmsg space reserved in each buffer
+    uint64_t rx_at[URING_NBUFS]; // when each buffer's datagram was reaped
+
+    // echoes go out as one chain of linked sends at a time: links run in
+    // order within a chain, but separate chains race each other
+    uint16_t chain[URING_NBUFS];   // bids of the chain in flight, in order
+    int chain_len, chain_left;     // its sends, and those not completed yet
+    uint8_t resend[URING_NBUFS];   // cancelled in the chain; goes out again
+    uint16_t pending[URING_NBUFS]; // echoes waiting for the next chain
+    unsigned pend_head, pend_tail;
+};
+
+int uring_setup(struct uring *r, unsigned entries, unsigned flags)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof p);
+    p.flags = flags | IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_NBUFS * 2;
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+        return -1;
+    r->features = p.features;
+    r->sq_entries = p.sq_entries;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto fail;
+    r->cq_ptr = r->sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    // sqe i always sits in slot i, so the indirection array is fixed
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        r->sq_array[i] = i;
+    r->sqe_tail = r->submitted = *r->sq_tail;
+    return 0;
+
+fail:
+    close(r->fd);
+    return -1;
+}
+
+void uring_free(struct uring *r)
+{
+    close(r->fd);
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    if (r->br != NULL)
+        munmap(r->br, URING_NBUFS * sizeof(struct io_uring_buf));
+    if (r->bufs != NULL)
+        munmap(r->bufs, (size_t)URING_NBUFS * URING_BUFSZ);
+}
+
+// hand everything queued since the last call to the kernel and optionally
+// wait for completions
+int uring_enter(struct uring *r, unsigned wait)
+{
+    unsigned n = r->sqe_tail - r->submitted;
+    int rv;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    do {
+        rv = syscall(__NR_io_uring_enter, r->fd, n, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rv == -1 && errno == EINTR);
+    if (rv >= 0)
+        r->submitted += rv;
+    return rv;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    // the SQ has room for a whole chain and the recv, so this never
+    // splits a chain
+    if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries &&
+        uring_enter(r, 0) == -1)
+        return NULL;
+    sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+// multishot recvmsg lays each buffer out as the recvmsg_out header, then
+// the reserved name and control space, then the datagram
+char *uring_payload(struct uring *r, struct io_uring_recvmsg_out *out)
+{
+    return (char *)out + sizeof *out + URING_NAMELEN + r->ctrllen;
+}
+
+void uring_recycle(struct uring *r, uint16_t bid)
+{
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (URING_NBUFS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * URING_BUFSZ);
+    b->len = URING_BUFSZ;
+    b->bid = bid;
+    r->br_tail++;
+}
+
+int uring_arm_recv(struct uring *r, int sockfd, struct msghdr *tmpl)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(r)) == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)tmpl;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = UD_RECV;
+    return 0;
+}
+
+// queue the echo of one received buffer as a link in the send chain. the
+// payload goes straight back out of the provided buffer it landed in, to
+// the source address the kernel wrote in front of it.
+int uring_queue_send(struct uring *r, int sockfd, uint16_t bid)
+{
+    struct io_uring_sqe *sqe;
+    char *buf = r->bufs + (size_t)bid * URING_BUFSZ;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+
+    if ((sqe = uring_get_sqe(r)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)uring_payload(r, out);
+    sqe->len = out->payloadlen;
+    sqe->addr2 = (uint64_t)(uintptr_t)(buf + sizeof *out);
+    sqe->addr_len = out->namelen;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = UD_SEND | bid;
+    if (r->fixed) {
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+        sqe->buf_index = 0;
+        sqe->user_data |= UD_FIXED;
+    }
+    return 0;
+}
+
+// once the last chain has completed, send the next one: its cancelled
+// sends first, then up to -b of the echoes queued since, so every echo
+// leaves in receive order. a send that can't be queued is dropped.
+void uring_next_chain(struct worker *w, struct uring *r, int sockfd)
+{
+    int n = 0;
+
+    if (r->chain_left > 0)
+        return;
+    for (int i = 0; i < r->chain_len; i++) {
+        uint16_t bid = r->chain[i];
+        if (r->resend[bid]) {
+            r->resend[bid] = 0;
+            r->chain[n++] = bid;
+        }
+    }
+    while (n < w->cfg->batch && r->pend_head != r->pend_tail)
+        r->chain[n++] = r->pending[r->pend_head++ & (URING_NBUFS - 1)];
+
+    r->chain_len = 0;
+    for (int i = 0; i < n; i++) {
+        if (uring_queue_send(r, sockfd, r->chain[i]) == -1) {
+            perror("io_uring_enter");
+            STAT_ADD(w, errors, 1);
+            uring_recycle(r, r->chain[i]);
+            continue;
+        }
+        r->sqes[(r->sqe_tail - 1) & *r->sq_mask].flags |= IOSQE_IO_LINK;
+        r->chain[r->chain_len++] = r->chain[i];
+    }
+    if (r->chain_len > 0)
+        r->sqes[(r->sqe_tail - 1) & *r->sq_mask].flags &= ~IOSQE_IO_LINK;
+    r->chain_left = r->chain_len;
+}
+
+// io_uring echo loop: one multishot recvmsg fed from a provided-buffer ring,
+// echoes sent as chains of linked sends straight out of those (registered)
+// buffers, one chain in flight at a time.
+// returns -1 without serving anything if the kernel can't do this.
+int echo_uring(struct worker *w)
+{
+    const struct server_config *cfg = w->cfg;
+    int sockfd = w->sockfd;
+    struct uring *r;
+    struct io_uring_buf_reg reg;
+    struct iovec fixed;
+    struct msghdr tmpl;
+    struct sockaddr_storage peer;
+    struct io_uring_cqe *cqe;
+    struct flow *f;
+    unsigned head, tail;
+    unsigned entries = 1;
+    uint64_t served = 0;
+    int armed = 1;
+
+    if ((r = calloc(1, sizeof *r)) == NULL)
+        return -1;
+    while (entries < (unsigned)cfg->batch * 2)
+        entries <<= 1;
+
+    // SINGLE_ISSUER | DEFER_TASKRUN keeps completion work on this thread
+    // until we ask for it (6.1+); retry without them on older kernels
+    if (uring_setup(r, entries, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) == -1 &&
+        uring_setup(r, entries, 0) == -1) {
+        free(r);
+        return -1;
+    }
+
+    r->bufs = mmap(NULL, (size_t)URING_NBUFS * URING_BUFSZ, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    r->br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (r->bufs == MAP_FAILED || r->br == MAP_FAILED) {
+        if (r->bufs == MAP_FAILED)
+            r->bufs = NULL;
+        if (r->br == MAP_FAILED)
+            r->br = NULL;
+        goto unsupported;
+    }
+
+    // provided-buffer rings need 5.19
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        goto unsupported;
+    for (int i = 0; i < URING_NBUFS; i++)
+        uring_recycle(r, i);
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+
+    // registering the same memory as fixed buffer 0 saves a page pin per
+    // send; it's only an optimization, so carry on without it if refused
+    fixed.iov_base = r->bufs;
+    fixed.iov_len = (size_t)URING_NBUFS * URING_BUFSZ;
+    r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, &fixed, 1) == 0;
+
+    memset(&tmpl, 0, sizeof tmpl);
+    tmpl.msg_namelen = URING_NAMELEN;
+    r->ctrllen = CMSG_SPACE(sizeof(uint32_t));
+    if (cfg->reflect)
+        r->ctrllen += CMSG_SPACE(sizeof(struct timespec));
+    tmpl.msg_controllen = r->ctrllen;
+    if (uring_arm_recv(r, sockfd, &tmpl) == -1)
+        goto unsupported;
+
+    while(1) {
+        // a chain's links are issued one after another as each completes,
+        // so wait for the whole chain rather than take it a send per pass
+        if (uring_enter(r, r->chain_left > 0 ? r->chain_left : 1) == -1) {
+            perror("io_uring_enter");
+            STAT_ADD(w, errors, 1);
+            continue;
+        }
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        int n = 0;
+        size_t bytes = 0;
+        // one clock read per pass: service time here is from the pass
+        // that reaped the datagram to the pass that reaped its send
+        uint64_t now = now_ns();
+        for (; head != tail; head++) {
+            cqe = &r->cqes[head & *r->cq_mask];
+            uint64_t ud = cqe->user_data;
+
+            if (UD_TYPE(ud) == UD_RECV) {
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    armed = 0;
+                if (cqe->res < 0) {
+                    // multishot recvmsg needs 6.0; older kernels reject it
+                    if (cqe->res == -EINVAL && served == 0)
+                        goto unsupported;
+                    // ENOBUFS just means every buffer is in flight
+                    if (cqe->res != -ENOBUFS) {
+                        fprintf(stderr, "io_uring recvmsg: %s\n", strerror(-cqe->res));
+                        STAT_ADD(w, errors, 1);
+                    }
+                    continue;
+                }
+                uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                struct io_uring_recvmsg_out *out =
+                    (struct io_uring_recvmsg_out *)(r->bufs + (size_t)bid * URING_BUFSZ);
+
+                // cut short like the other loops do: echo what fit
+                if (out->flags & MSG_TRUNC)
+                    out->payloadlen = URING_BUFSZ - (uring_payload(r, out) - (char *)out);
+                // wrap the control bytes the kernel wrote so the cmsg
+                // macros can walk them
+                struct msghdr cm;
+                memset(&cm, 0, sizeof cm);
+                cm.msg_control = (char *)out + sizeof *out + URING_NAMELEN;
+                cm.msg_controllen = out->controllen;
+                rx_drops(w, &cm);
+
+                served++;
+                STAT_ADD(w, rx_pkts, 1);
+                STAT_ADD(w, rx_bytes, out->payloadlen);
+                if (!admit(w, (struct sockaddr_storage *)((char *)out + sizeof *out), 1, now)) {
+                    uring_recycle(r, bid);
+                    continue;
+                }
+                if (n == 0)
+                    memcpy(&peer, (char *)out + sizeof *out, sizeof(struct sockaddr_in));
+                n++;
+                bytes += out->payloadlen;
+                f = flow_update(w, (struct sockaddr_storage *)((char *)out + sizeof *out),
+                                uring_payload(r, out), out->payloadlen, out->payloadlen);
+                out->payloadlen = echo_fixup(w, f, uring_payload(r, out), out->payloadlen,
+                                             out->payloadlen, cfg->reflect ? rx_timestamp(&cm) : 0);
+                r->rx_at[bid] = now;
+                r->pending[r->pend_tail++ & (URING_NBUFS - 1)] = bid;
+            } else if (UD_TYPE(ud) == UD_SEND) {
+                uint16_t bid = UD_BID(ud);
+
+                r->chain_left--;
+                if (cqe->res >= 0) {
+                    STAT_ADD(w, tx_pkts, 1);
+                    hist_add(&w->svc, now - r->rx_at[bid], 1);
+                    uring_recycle(r, bid);
+                    continue;
+                }
+
+                // a failed send cancels the rest of its chain, whoever
+                // they were for; those go out again in the next one. not
+                // every kernel takes IORING_OP_SEND from a fixed buffer:
+                // the first such send fails with EINVAL, so switch to
+                // normal sends and send it again too
+                if ((ud & UD_FIXED) && cqe->res == -EINVAL && r->fixed) {
+                    r->fixed = 0;
+                    if (!cfg->quiet)
+                        printf("server: fixed-buffer sends not supported, using normal sends\n");
+                }
+                if (cqe->res == -ECANCELED || ((ud & UD_FIXED) && !r->fixed && cqe->res == -EINVAL)) {
+                    r->resend[bid] = 1;
+                    continue;
+                }
+                fprintf(stderr, "io_uring send: %s\n", strerror(-cqe->res));
+                STAT_ADD(w, errors, 1);
+                uring_recycle(r, bid);
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+        uring_next_chain(w, r, sockfd);
+
+        if (n > 0)
+            log_echo(w, LOG_BATCH, n, bytes, &peer);
+
+        if (!armed) {
+            if (uring_arm_recv(r, sockfd, &tmpl) == -1) {
+                perror("io_uring_enter");
+                STAT_ADD(w, errors, 1);
+            } else {
+                armed = 1;
+            }
+        }
+    }
+
+unsupported:
+    uring_free(r);
+    free(r);
+    return -1;
+}
+#else
+// built without io_uring headers
+int echo_uring(struct worker *w)
+{
+    (void)w;
+    return -1;
+}
+#endif
+
+void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0)
+            fprintf(stderr, "server: worker %d: could not pin to cpu %d\n", w->id, w->cpu);
+    }
+
+    if (w->cfg->mode == MODE_URING && echo_uring(w) == -1)
+        fprintf(stderr, "server: worker %d: io_uring not available, using plain recvfrom/sendto\n", w->id);
+
+    if (w->cfg->mode == MODE_MMSG)
+        echo_mmsg(w);
+    else
+        echo_plain(w);
+    return NULL;
+}
+
+void on_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        dump = 1;
+    else
+        stop = 1;
+}
+
+// print every worker's flow table. runs on the main thread while the
+// workers keep going, so each line is a snapshot, not an atomic one.
+void dump_flows(int nworkers)
+{
+    char ip[INET_ADDRSTRLEN];
+    uint64_t untracked = 0;
+    int nflows = 0;
+
+    printf("server: flow table\n");
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+
+        untracked += __atomic_load_n(&w->stats.untracked, __ATOMIC_RELAXED);
+        if (w->flows == NULL)
+            continue;
+        for (int j = 0; j < w->cfg->flows; j++) {
+            struct flow *f = &w->flows[j];
+            uint16_t port = __atomic_load_n(&f->port, __ATOMIC_ACQUIRE);
+            uint64_t pkts = __atomic_load_n(&f->pkts, __ATOMIC_RELAXED);
+            uint32_t lost = __atomic_load_n(&f->lost, __ATOMIC_RELAXED);
+            uint32_t dups = __atomic_load_n(&f->dups, __ATOMIC_RELAXED);
+
+            if (port == 0)
+                continue;
+            inet_ntop(AF_INET, &f->addr, ip, sizeof ip);
+            printf("flow %s:%d worker %d pkts %llu bytes %llu last_seq %u lost %u (%.3f%%) "
+                   "gaps %u reorders %u dups %u restarts %u\n",
+                   ip, ntohs(port), i, (unsigned long long)pkts,
+                   (unsigned long long)__atomic_load_n(&f->bytes, __ATOMIC_RELAXED),
+                   __atomic_load_n(&f->max_seq, __ATOMIC_RELAXED),
+                   lost, pkts - dups + lost ? 100.0 * lost / (pkts - dups + lost) : 0.0,
+                   __atomic_load_n(&f->gaps, __ATOMIC_RELAXED),
+                   __atomic_load_n(&f->reorders, __ATOMIC_RELAXED), dups,
+                   __atomic_load_n(&f->restarts, __ATOMIC_RELAXED));
+            nflows++;
+        }
+    }
+    printf("server: %d flows, %llu datagrams untracked (table full)\n",
+           nflows, (unsigned long long)untracked);
+
+    // sources that hit the -s limit; the overflow bucket is the last slot.
+    // the workers share one table
+    if (workers[0].buckets != NULL) {
+        for (int j = 0; j <= BUCKETS; j++) {
+            struct bucket *b = &workers[0].buckets[j];
+            uint64_t dropped = __atomic_load_n(&b->dropped, __ATOMIC_RELAXED);
+
+            if (dropped == 0)
+                continue;
+            if (j == BUCKETS)
+                snprintf(ip, sizeof ip, "(table full)");
+            else if (__atomic_load_n(&b->used, __ATOMIC_ACQUIRE) == 2)
+                inet_ntop(AF_INET, &b->addr, ip, sizeof ip);
+            else
+                continue;
+            printf("limited %s dropped %llu\n", ip, (unsigned long long)dropped);
+        }
+    }
+    fflush(stdout);
+}
+
+// snapshot one worker's counters; each is a single relaxed load, so the
+// snapshot costs the worker nothing but is not atomic as a whole
+void stats_load(struct worker *w, struct worker_stats *cur)
+{
+    cur->rx_pkts = __atomic_load_n(&w->stats.rx_pkts, __ATOMIC_RELAXED);
+    cur->rx_bytes = __atomic_load_n(&w->stats.rx_bytes, __ATOMIC_RELAXED);
+    cur->tx_pkts = __atomic_load_n(&w->stats.tx_pkts, __ATOMIC_RELAXED);
+    cur->errors = __atomic_load_n(&w->stats.errors, __ATOMIC_RELAXED);
+    cur->untracked = __atomic_load_n(&w->stats.untracked, __ATOMIC_RELAXED);
+    cur->busy_sleeps = __atomic_load_n(&w->stats.busy_sleeps, __ATOMIC_RELAXED);
+    cur->limited = __atomic_load_n(&w->stats.limited, __ATOMIC_RELAXED);
+    cur->shed = __atomic_load_n(&w->stats.shed, __ATOMIC_RELAXED);
+    cur->overloads = __atomic_load_n(&w->stats.overloads, __ATOMIC_RELAXED);
+    cur->rxq_ovfl = __atomic_load_n(&w->stats.rxq_ovfl, __ATOMIC_RELAXED);
+    cur->crc_ok = __atomic_load_n(&w->stats.crc_ok, __ATOMIC_RELAXED);
+    cur->crc_bad = __atomic_load_n(&w->stats.crc_bad, __ATOMIC_RELAXED);
+    cur->compact = __atomic_load_n(&w->stats.compact, __ATOMIC_RELAXED);
+    cur->unsynced = __atomic_load_n(&w->stats.unsynced, __ATOMIC_RELAXED);
+}
+
+void stats_sum(struct worker_stats *total, const struct worker_stats *cur)
+{
+    total->rx_pkts += cur->rx_pkts;
+    total->rx_bytes += cur->rx_bytes;
+    total->tx_pkts += cur->tx_pkts;
+    total->errors += cur->errors;
+    total->untracked += cur->untracked;
+    total->busy_sleeps += cur->busy_sleeps;
+    total->limited += cur->limited;
+    total->shed += cur->shed;
+    total->overloads += cur->overloads;
+    total->rxq_ovfl += cur->rxq_ovfl;
+    total->crc_ok += cur->crc_ok;
+    total->crc_bad += cur->crc_bad;
+    total->compact += cur->compact;
+    total->unsynced += cur->unsynced;
+}
+
+// sum every worker's counters and print one line, plus a per-worker
+// breakdown when there is more than one. secs is the time since the
+// last report, for the rates; 0 leaves them out.
+void report(int nworkers, struct worker_stats *last, double secs)
+{
+    struct worker_stats total = {0}, cur;
+    static struct hist svc;
+    uint64_t delta = 0;
+    uint64_t logged = 0, skipped = 0, dropped = 0;
+
+    memset(&svc, 0, sizeof svc);
+    for (int i = 0; i < nworkers; i++) {
+        stats_load(&workers[i], &cur);
+        stats_sum(&total, &cur);
+        hist_merge(&svc, &workers[i].svc);
+        delta += cur.rx_pkts - last[i].rx_pkts;
+        if (nworkers > 1 && secs > 0)
+            printf("server: worker %d: %.0f pps\n", i,
+                   (cur.rx_pkts - last[i].rx_pkts) / secs);
+        last[i] = cur;
+        if (workers[i].log != NULL) {
+            logged += __atomic_load_n(&workers[i].log->logged, __ATOMIC_RELAXED);
+            skipped += __atomic_load_n(&workers[i].log->skipped, __ATOMIC_RELAXED);
+            dropped += __atomic_load_n(&workers[i].log->dropped, __ATOMIC_RELAXED);
+        }
+    }
+
+    printf("server: received %llu datagrams (%llu bytes), echoed %llu, errors %llu",
+           (unsigned long long)total.rx_pkts, (unsigned long long)total.rx_bytes,
+           (unsigned long long)total.tx_pkts, (unsigned long long)total.errors);
+    if (secs > 0)
+        printf(", %.0f pps", delta / secs);
+    if (total.rxq_ovfl > 0)
+        printf(", %llu dropped by the kernel (queue full)", (unsigned long long)total.rxq_ovfl);
+    if (workers[0].cfg->busy_us > 0)
+        printf(", busy-poll sleeps %llu", (unsigned long long)total.busy_sleeps);
+    printf("\n");
+    if (total.crc_ok + total.crc_bad > 0)
+        printf("server: CRC32C (%s): %llu ok, %llu corrupted\n", crc32c_impl,
+               (unsigned long long)total.crc_ok, (unsigned long long)total.crc_bad);
+    if (total.compact > 0)
+        printf("server: compact headers: %llu messages, %llu undecodable (their sync was lost)\n",
+               (unsigned long long)total.compact, (unsigned long long)total.unsynced);
+    if (svc.total > 0)
+        printf("server: service time p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               hist_pct(&svc, 0.5) / 1e3, hist_pct(&svc, 0.99) / 1e3,
+               hist_pct(&svc, 0.999) / 1e3, svc.max / 1e3);
+    if (workers[0].cfg->rate > 0 || workers[0].cfg->overload > 0)
+        printf("server: dropped %llu over source rate limit, shed %llu unread in %llu overloads\n",
+               (unsigned long long)total.limited, (unsigned long long)total.shed,
+               (unsigned long long)total.overloads);
+    if (workers[0].log != NULL)
+        printf("server: log: %llu lines, %llu sampled out, %llu dropped (ring full)\n",
+               (unsigned long long)logged, (unsigned long long)skipped,
+               (unsigned long long)dropped);
+    fflush(stdout);
+}
+
+// listen on a UNIX stream socket for stats queries
+int stats_open(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (strlen(path) >= sizeof sun.sun_path) {
+        fprintf(stderr, "server: stats socket path too long\n");
+        return -1;
+    }
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("server: stats socket");
+        return -1;
+    }
+    // a stale socket from a previous run would make bind fail
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof sun) == -1 || listen(fd, 8) == -1) {
+        perror("server: stats bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// write one snapshot as "name value" lines, then the non-empty service
+// time buckets as "svc_bucket <lowest ns> <count>" so a collector can
+// merge histograms from several servers
+void stats_write(FILE *f, int nworkers)
+{
+    static struct worker_stats last;
+    static uint64_t last_ns;
+    static struct hist svc;
+    struct worker_stats total = {0}, cur;
+    uint64_t now = now_ns();
+    double secs;
+
+    memset(&svc, 0, sizeof svc);
+    for (int i = 0; i < nworkers; i++) {
+        stats_load(&workers[i], &cur);
+        stats_sum(&total, &cur);
+        hist_merge(&svc, &workers[i].svc);
+    }
+    // rates are since the previous query, or since startup for the first
+    if (last_ns == 0)
+        last_ns = start_ns;
+    secs = (now - last_ns) * 1e-9;
+
+    fprintf(f, "uptime_s %.3f\n", (now - start_ns) * 1e-9);
+    fprintf(f, "workers %d\n", nworkers);
+    fprintf(f, "rx_pkts %llu\n", (unsigned long long)total.rx_pkts);
+    fprintf(f, "rx_bytes %llu\n", (unsigned long long)total.rx_bytes);
+    fprintf(f, "tx_pkts %llu\n", (unsigned long long)total.tx_pkts);
+    fprintf(f, "errors %llu\n", (unsigned long long)total.errors);
+    fprintf(f, "rxq_ovfl %llu\n", (unsigned long long)total.rxq_ovfl);
+    fprintf(f, "untracked %llu\n", (unsigned long long)total.untracked);
+    fprintf(f, "limited %llu\n", (unsigned long long)total.limited);
+    fprintf(f, "shed %llu\n", (unsigned long long)total.shed);
+    fprintf(f, "overloads %llu\n", (unsigned long long)total.overloads);
+    fprintf(f, "busy_sleeps %llu\n", (unsigned long long)total.busy_sleeps);
+    fprintf(f, "crc_ok %llu\n", (unsigned long long)total.crc_ok);
+    fprintf(f, "crc_bad %llu\n", (unsigned long long)total.crc_bad);
+    fprintf(f, "compact %llu\n", (unsigned long long)total.compact);
+    fprintf(f, "compact_unsynced %llu\n", (unsigned long long)total.unsynced);
+    fprintf(f, "rx_pps %.0f\n", secs > 0 ? (total.rx_pkts - last.rx_pkts) / secs : 0.0);
+    fprintf(f, "rx_bps %.0f\n", secs > 0 ? (total.rx_bytes - last.rx_bytes) * 8 / secs : 0.0);
+    fprintf(f, "tx_pps %.0f\n", secs > 0 ? (total.tx_pkts - last.tx_pkts) / secs : 0.0);
+    fprintf(f, "svc_count %llu\n", (unsigned long long)svc.total);
+    fprintf(f, "svc_p50_ns %llu\n", (unsigned long long)hist_pct(&svc, 0.5));
+    fprintf(f, "svc_p90_ns %llu\n", (unsigned long long)hist_pct(&svc, 0.9));
+    fprintf(f, "svc_p99_ns %llu\n", (unsigned long long)hist_pct(&svc, 0.99));
+    fprintf(f, "svc_p999_ns %llu\n", (unsigned long long)hist_pct(&svc, 0.999));
+    fprintf(f, "svc_max_ns %llu\n", (unsigned long long)svc.max);
+    hist_write(f, "svc_bucket", &svc);
+    last = total;
+    last_ns = now;
+}
+
+// stats thread: answer each connection on the -S socket with a snapshot
+// and close it, e.g. `nc -U /tmp/server11.sock`. it only reads the
+// workers' counters, so a query never stalls the echo path.
+void *stats_main(void *arg)
+{
+    int nworkers = *(int *)arg;
+    FILE *f;
+    int fd;
+
+    while (1) {
+        if ((fd = accept(stats_fd, NULL, NULL)) == -1) {
+            if (errno != EINTR)
+                perror("server: stats accept");
+            continue;
+        }
+        if ((f = fdopen(fd, "w")) == NULL) {
+            close(fd);
+            continue;
+        }
+        stats_write(f, nworkers);
+        fclose(f);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int sockfd;
+    int opt;
+    struct server_config cfg = { .mode = MODE_PLAIN, .batch = 64, .workers = 1, .log_every = 1,
+                                 .flows = 4096, .maxlen = MAXBUFLEN - 1 };
+    pthread_t logger, stats;
+    static struct worker_stats last[MAXWORKERS];
+    struct sigaction sa;
+    sigset_t sigs, oldsigs;
+
+    while ((opt = getopt(argc, argv, "m:b:t:qw:c:r:gl:L:F:Rp:s:o:S:M:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "plain") == 0)
+                cfg.mode = MODE_PLAIN;
+            else if (strcmp(optarg, "mmsg") == 0)
+                cfg.mode = MODE_MMSG;
+            else if (strcmp(optarg, "uring") == 0)
+                cfg.mode = MODE_URING;
+            else
+                usage();
+            break;
+        case 'b':
+            cfg.batch = atoi(optarg);
+            if (cfg.batch < 1 || cfg.batch > MAXBATCH)
+                usage();
+            break;
+        case 't':
+            cfg.timeout_us = atol(optarg);
+            if (cfg.timeout_us < 0)
+                usage();
+            break;
+        case 'q':
+            cfg.quiet = 1;
+            break;
+        case 'w':
+            cfg.workers = atoi(optarg);
+            if (cfg.workers < 1 || cfg.workers > MAXWORKERS)
+                usage();
+            break;
+        case 'c':
+            if (parse_cpus(optarg, &cfg) == -1)
+                usage();
+            break;
+        case 'r':
+            cfg.report_secs = atoi(optarg);
+            if (cfg.report_secs < 0)
+                usage();
+            break;
+        case 'g':
+            cfg.gro = 1;
+            break;
+        case 'l':
+            cfg.log_every = atoi(optarg);
+            if (cfg.log_every < 1)
+                usage();
+            break;
+        case 'L':
+            cfg.log_rate = atoi(optarg);
+            if (cfg.log_rate < 0)
+                usage();
+            break;
+        case 'R':
+            cfg.reflect = 1;
+            break;
+        case 'p':
+            cfg.busy_us = atol(optarg);
+            if (cfg.busy_us < 1 || cfg.busy_us > 1000000)
+                usage();
+            break;
+        case 's': {
+            char *end;
+            cfg.rate = strtod(optarg, &end);
+            cfg.burst = *end == ':' ? strtod(end + 1, &end) : cfg.rate;
+            if (*end != '\0' || cfg.rate <= 0 || cfg.burst < 1)
+                usage();
+            break;
+        }
+        case 'o':
+            cfg.overload = atoi(optarg);
+            if (cfg.overload < 1 || cfg.overload > 100)
+                usage();
+            break;
+        case 'S':
+            cfg.stats_path = optarg;
+            break;
+        case 'M':
+            cfg.maxlen = atoi(optarg);
+            if (cfg.maxlen < 1 || cfg.maxlen > MAXDGRAM)
+                usage();
+            break;
+        case 'F':
+            cfg.flows = atoi(optarg);
+            if (cfg.flows < 0 || (cfg.flows & (cfg.flows - 1)) != 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (cfg.gro && cfg.mode != MODE_MMSG) {
+        fprintf(stderr, "server: -g needs -m mmsg\n");
+        usage();
+    }
+    if (cfg.busy_us > 0 && cfg.mode == MODE_URING) {
+        fprintf(stderr, "server: -p needs -m plain or -m mmsg\n");
+        usage();
+    }
+    if (cfg.overload > 0 && cfg.mode == MODE_URING) {
+        fprintf(stderr, "server: -o needs -m plain or -m mmsg\n");
+        usage();
+    }
+    if (cfg.maxlen != MAXBUFLEN - 1 && cfg.mode == MODE_URING) {
+        fprintf(stderr, "server: -M needs -m plain or -m mmsg\n");
+        usage();
+    }
+
+    // open every socket before starting any worker so a bind failure
+    // doesn't leave half the workers running
+    for (int i = 0; i < cfg.workers; i++) {
+        if ((sockfd = open_socket(cfg.workers > 1, cfg.reflect)) == -1)
+            return 2;
+        workers[i].id = i;
+        workers[i].sockfd = sockfd;
+        workers[i].cpu = cfg.ncpus > 0 ? cfg.cpus[i % cfg.ncpus] : -1;
+        workers[i].cfg = &cfg;
+        if (!cfg.quiet && (workers[i].log = calloc(1, sizeof *workers[i].log)) == NULL) {
+            perror("server: malloc");
+            return 1;
+        }
+        if (cfg.flows > 0 &&
+            (workers[i].flows = aligned_alloc(64, cfg.flows * sizeof(struct flow))) == NULL) {
+            perror("server: malloc");
+            return 1;
+        }
+        if (workers[i].flows != NULL)
+            memset(workers[i].flows, 0, cfg.flows * sizeof(struct flow));
+        if (cfg.rate > 0 && i > 0)
+            workers[i].buckets = workers[0].buckets;
+        else if (cfg.rate > 0 &&
+                 (workers[i].buckets = calloc(BUCKETS + 1, sizeof(struct bucket))) == NULL) {
+            perror("server: malloc");
+            return 1;
+        }
+    }
+    if (cfg.stats_path != NULL && (stats_fd = stats_open(cfg.stats_path)) == -1)
+        return 2;
+    start_ns = now_ns();
+
+    printf("UDP Echo Server: waiting for connections on port %s...\n", PORT);
+    if (cfg.mode == MODE_MMSG)
+        printf("server: batched mode, up to %d datagrams per call\n", cfg.batch);
+    else if (cfg.mode == MODE_URING)
+        printf("server: io_uring mode, up to %d sends per linked chain\n", cfg.batch);
+    if (cfg.gro)
+        printf("server: UDP_GRO receive, UDP_SEGMENT echo\n");
+    if (cfg.reflect)
+        printf("server: reflector mode, stamping receive/transmit times\n");
+    if (cfg.busy_us > 0)
+        printf("server: busy-polling, %ld us spin window\n", cfg.busy_us);
+    if (cfg.rate > 0)
+        printf("server: limiting each source to %.0f datagrams/s, burst %.0f\n",
+               cfg.rate, cfg.burst);
+    if (cfg.overload > 0)
+        printf("server: shedding when the receive queue passes %d%% of SO_RCVBUF\n",
+               cfg.overload);
+    if (cfg.workers > 1)
+        printf("server: %d workers on SO_REUSEPORT sockets\n", cfg.workers);
+    if (cfg.stats_path != NULL)
+        printf("server: stats on %s\n", cfg.stats_path);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    // a stats client that hangs up early must not kill the server
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    // workers inherit a mask with our signals blocked so they always land
+    // on the main thread instead of interrupting a recv
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+    if (!cfg.quiet &&
+        (opt = pthread_create(&logger, NULL, logger_main, &cfg.workers)) != 0) {
+        fprintf(stderr, "server: pthread_create: %s\n", strerror(opt));
+        return 1;
+    }
+
+    if (stats_fd != -1 &&
+        (opt = pthread_create(&stats, NULL, stats_main, &cfg.workers)) != 0) {
+        fprintf(stderr, "server: pthread_create: %s\n", strerror(opt));
+        return 1;
+    }
+
+    // Main server loop, one per worker
+    for (int i = 0; i < cfg.workers; i++) {
+        if ((opt = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) != 0) {
+            fprintf(stderr, "server: pthread_create: %s\n", strerror(opt));
+            return 1;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    // the main thread only reports; workers run until the process exits.
+    // rates are over the time that actually passed, which a late wakeup
+    // or the last partial interval make differ from -r
+    uint64_t last_ns = now_ns(), now;
+    while (!stop) {
+        if (cfg.report_secs > 0) {
+            // sleep() returns early on SIGUSR1; finish the interval after
+            unsigned left = cfg.report_secs;
+            while ((left = sleep(left)) > 0 && !stop) {
+                if (dump) {
+                    dump = 0;
+                    dump_flows(cfg.workers);
+                }
+            }
+            if (!stop) {
+                now = now_ns();
+                report(cfg.workers, last, (now - last_ns) / 1e9);
+                last_ns = now;
+            }
+        } else {
+            pause();
+        }
+        if (dump) {
+            dump = 0;
+            dump_flows(cfg.workers);
+        }
+    }
+
+    report(cfg.workers, last, cfg.report_secs > 0 ? (now_ns() - last_ns) / 1e9 : 0);
+    if (cfg.flows > 0 || cfg.rate > 0)
+        dump_flows(cfg.workers);
+
+    for (int i = 0; i < cfg.workers; i++)
+        close(workers[i].sockfd);
+    if (stats_fd != -1)
+        unlink(cfg.stats_path);
     return 0;
-}
\ No newline at end of file
+}
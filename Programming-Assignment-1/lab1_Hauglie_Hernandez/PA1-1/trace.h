@@ -0,0 +1,228 @@
+// compact binary traffic traces for client11c (-t to record, -p to replay).
+//
+// a trace is a 16 byte header ("UDPTRC1\0" and the wall clock start in ns,
+// little-endian) followed by chunks. every chunk is a 12 byte header (the
+// length of its records as a u32 and its start as a u64, ns since the
+// trace began) and then records of three LEB128 varints:
+//
+//     ns since the previous record in the chunk (0 for the first)
+//     datagram size in bytes
+//     flow id << 1 | direction (0 = sent, 1 = received)
+//
+// so a record is 3-8 bytes. each thread fills its own chunk and appends
+// it whole, so sends stay in time order with each other, and so do
+// receives. a reader only ever looks at one chunk at a time, and the file
+// is mmapped, so multi-GB traces cost no more memory than small ones.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC "UDPTRC1"
+#define TRACE_HDRLEN 16
+#define TRACE_CHUNKHDR 12
+#define TRACE_CHUNK 65536 // record bytes per chunk
+#define TRACE_MAXREC 30   // three varints of up to 10 bytes
+
+enum { TRACE_SENT, TRACE_RECV };
+
+struct trace_rec {
+    uint64_t t_ns;  // since the trace began
+    uint32_t size;
+    uint32_t flow;
+    int dir;
+};
+
+// shared by the threads writing one trace
+struct trace_writer {
+    FILE *f;
+    pthread_mutex_t lock;
+    uint64_t t0;    // CLOCK_MONOTONIC at the start
+};
+
+// one per writing thread
+struct trace_chunk {
+    uint64_t base, last;
+    size_t len;
+    uint8_t buf[TRACE_CHUNK];
+};
+
+static inline void trace_le(uint8_t *p, uint64_t v, int n)
+{
+    for (int i = 0; i < n; i++)
+        p[i] = v >> (8 * i);
+}
+
+static inline uint64_t trace_get_le(const uint8_t *p, int n)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < n; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static inline size_t trace_put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// returns 0 on a truncated varint
+static inline size_t trace_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    size_t n = 0;
+
+    *v = 0;
+    while (p + n < end && n < 10) {
+        *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n++] & 0x80))
+            return n;
+    }
+    return 0;
+}
+
+static inline int trace_create(struct trace_writer *w, const char *path, uint64_t t0, uint64_t wall)
+{
+    uint8_t hdr[TRACE_HDRLEN];
+
+    if ((w->f = fopen(path, "w")) == NULL)
+        return -1;
+    memcpy(hdr, TRACE_MAGIC, 8);
+    trace_le(hdr + 8, wall, 8);
+    fwrite(hdr, 1, sizeof hdr, w->f);
+    pthread_mutex_init(&w->lock, NULL);
+    w->t0 = t0;
+    return 0;
+}
+
+// append c to the file and start it over
+static inline void trace_flush(struct trace_writer *w, struct trace_chunk *c)
+{
+    uint8_t hdr[TRACE_CHUNKHDR];
+
+    if (c->len == 0)
+        return;
+    trace_le(hdr, c->len, 4);
+    trace_le(hdr + 4, c->base, 8);
+    pthread_mutex_lock(&w->lock);
+    fwrite(hdr, 1, sizeof hdr, w->f);
+    fwrite(c->buf, 1, c->len, w->f);
+    pthread_mutex_unlock(&w->lock);
+    c->len = 0;
+}
+
+static inline void trace_put(struct trace_writer *w, struct trace_chunk *c, uint64_t now,
+                             uint32_t size, uint32_t flow, int dir)
+{
+    uint64_t t = now > w->t0 ? now - w->t0 : 0;
+
+    if (c->len + TRACE_MAXREC > TRACE_CHUNK)
+        trace_flush(w, c);
+    if (c->len == 0)
+        c->base = c->last = t;
+    if (t < c->last)
+        t = c->last;
+    c->len += trace_put_varint(c->buf + c->len, t - c->last);
+    c->len += trace_put_varint(c->buf + c->len, size);
+    c->len += trace_put_varint(c->buf + c->len, (uint64_t)flow << 1 | dir);
+    c->last = t;
+}
+
+// flush every thread's chunk before this
+static inline int trace_finish(struct trace_writer *w)
+{
+    int rv = fclose(w->f);
+
+    pthread_mutex_destroy(&w->lock);
+    return rv;
+}
+
+struct trace_reader {
+    const uint8_t *map;
+    size_t len;
+    size_t at, chunk_end;
+    uint64_t t;
+};
+
+static inline int trace_open(struct trace_reader *r, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    memset(r, 0, sizeof *r);
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || st.st_size < TRACE_HDRLEN) {
+        close(fd);
+        return -1;
+    }
+    r->len = st.st_size;
+    r->map = mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED || memcmp(r->map, TRACE_MAGIC, 8) != 0) {
+        if (r->map != MAP_FAILED)
+            munmap((void *)r->map, r->len);
+        r->map = NULL;
+        return -1;
+    }
+    madvise((void *)r->map, r->len, MADV_SEQUENTIAL);
+    r->at = r->chunk_end = TRACE_HDRLEN;
+    return 0;
+}
+
+// next record in file order. returns 1, 0 at the end, -1 if the trace is
+// cut short or corrupt.
+static inline int trace_next(struct trace_reader *r, struct trace_rec *rec)
+{
+    uint64_t d, size, fd;
+    size_t n1, n2, n3;
+    const uint8_t *p, *end;
+
+    if (r->at == r->chunk_end) {
+        if (r->at == r->len)
+            return 0;
+        if (r->len - r->at < TRACE_CHUNKHDR)
+            return -1;
+        r->chunk_end = r->at + TRACE_CHUNKHDR + trace_get_le(r->map + r->at, 4);
+        r->t = trace_get_le(r->map + r->at + 4, 8);
+        r->at += TRACE_CHUNKHDR;
+        if (r->chunk_end > r->len)
+            return -1;
+    }
+    p = r->map + r->at;
+    end = r->map + r->chunk_end;
+    if ((n1 = trace_get_varint(p, end, &d)) == 0 ||
+        (n2 = trace_get_varint(p + n1, end, &size)) == 0 ||
+        (n3 = trace_get_varint(p + n1 + n2, end, &fd)) == 0)
+        return -1;
+    r->at += n1 + n2 + n3;
+    r->t += d;
+    rec->t_ns = r->t;
+    rec->size = size;
+    rec->flow = fd >> 1;
+    rec->dir = fd & 1;
+    return 1;
+}
+
+static inline void trace_close(struct trace_reader *r)
+{
+    if (r->map != NULL)
+        munmap((void *)r->map, r->len);
+    r->map = NULL;
+}
+
+#endif
@@ -0,0 +1,111 @@
+// kernel send/receive timestamps (SO_TIMESTAMPING) shared by client11b
+// and client11c.
+//
+// the kernel stamps each datagram as the driver takes it for transmit and
+// as it comes in from the device, in software and, when the NIC has been
+// set up for it (e.g. hwstamp_ctl -i eth0 -t 1 -r 1), in hardware too.
+// TX stamps come back on the socket's error queue, tagged with a counter
+// of the socket's sends (OPT_ID, starting at 0). RX stamps ride along
+// with the datagram as a control message. rx - tx is the RTT without the
+// scheduler wakeups and syscalls that a user space RTT also pays for.
+#ifndef TSTAMP_H
+#define TSTAMP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+// a control buffer for either direction: the stamps plus the error queue
+// entry that carries the TX key
+#define TSTAMP_CTRLLEN (CMSG_SPACE(sizeof(struct scm_timestamping)) + \
+                        CMSG_SPACE(sizeof(struct sock_extended_err) + \
+                                   sizeof(struct sockaddr_in6)))
+
+// ns since the epoch; 0 when that kind of stamp wasn't taken
+struct kstamp {
+    uint64_t sw;
+    uint64_t hw;
+};
+
+// ask for software and hardware stamps both ways. must be done before the
+// first send so the TX keys line up with the sends from 0.
+static inline int tstamp_enable(int fd)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+                SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof flags);
+}
+
+static inline uint64_t tstamp_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// pull the stamps out of a received msghdr. returns 1 if there were any.
+// the hardware stamp is kept as the NIC's raw clock (ts[2]).
+static inline int tstamp_parse(struct msghdr *msg, struct kstamp *ks)
+{
+    struct cmsghdr *cm;
+    struct scm_timestamping tss;
+
+    ks->sw = ks->hw = 0;
+    for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+            memcpy(&tss, CMSG_DATA(cm), sizeof tss);
+            ks->sw = tstamp_ns(&tss.ts[0]);
+            ks->hw = tstamp_ns(&tss.ts[2]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// read one TX stamp off the error queue without blocking. returns 1 with
+// the send's key and stamps, 0 once the queue is empty, -1 on error.
+// software and hardware stamps for one send can arrive as separate
+// entries with the same key.
+static inline int tstamp_tx(int fd, uint32_t *key, struct kstamp *ks)
+{
+    char data[64];
+    char ctrl[TSTAMP_CTRLLEN];
+    struct iovec iov = { data, sizeof data };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err ee;
+
+    for (;;) {
+        int have_key = 0;
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof ctrl;
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                memcpy(&ee, CMSG_DATA(cm), sizeof ee);
+                if (ee.ee_errno == ENOMSG && ee.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                    *key = ee.ee_data;
+                    have_key = 1;
+                }
+            }
+        }
+        // anything else on the error queue isn't ours to report
+        if (have_key && tstamp_parse(&msg, ks))
+            return 1;
+    }
+}
+
+#endif